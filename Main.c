@@ -29,10 +29,14 @@
 // Decomment to activate normal operation using SPI
 #define SPI_COMMUNICATION
 
+// Decomment to inject network faults, configured with command #38
+//#define FAULT_INJECTION
+
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <Core/RtxCore.h>
 #include <Ros/RosCfg.h>
@@ -69,27 +73,596 @@
 #define PRINT(x) UartPrint((rsuint8*)x)
 #define PRINTLN(x) UartPrintLn((rsuint8*)x)
 
+// Log levels. Messages above LOG_LEVEL are removed at compile time.
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Log a tokenised message with two arguments (see LogMsgType)
+#define LOG(level, msg, a, b) do { \
+    if ((level) <= LOG_LEVEL) \
+      log_write((level), (msg), (rsuint32)(a), (rsuint32)(b)); \
+  } while (0)
+#define LOG_ERROR(msg, a, b) LOG(LOG_LEVEL_ERROR, msg, a, b)
+#define LOG_WARNING(msg, a, b) LOG(LOG_LEVEL_WARNING, msg, a, b)
+#define LOG_INFO(msg, a, b) LOG(LOG_LEVEL_INFO, msg, a, b)
+#define LOG_DEBUG(msg, a, b) LOG(LOG_LEVEL_DEBUG, msg, a, b)
+
+// Number of log records kept in RAM, and records printed per
+// housekeeping tick in terminal builds
+#define LOG_RING_LENGTH 32
+#define LOG_FLUSH_BATCH 4
+
+// Default battery capacity for the energy estimator, in mAh
+#define ENERGY_DEFAULT_BATTERY 2000
+
+// Size of a log record read with command #26
+#define LOG_RECORD_SIZE 13
+
 // Buffer sizes
 #define TMP_STR_LENGTH 100
 #define CMD_STR_LENGTH TMP_STR_LENGTH
 #define TX_BUFFER_LENGTH 500
 
+// Buffer pool shared by the SPI commands and the TX queue. Three blocks
+// are reserved for PtMain: the command and frame buffers, and the body of
+// command #32 or the parsing of an AP profile.
+#define POOL_BLOCK_SIZE 512
+#define POOL_BLOCK_COUNT 7
+#define POOL_RESERVED_BLOCKS 3
+
 // Maximum number of arguments for terminal commands
 #define MAX_ARGV 3
 
 // Timeout in seconds for DNS resolutions
 #define APP_DNS_RESOLVE_RSP_TIMEOUT (10*RS_T1SEC)
 
+// Number of socket receive buffers which can be kept until read
+#define RX_QUEUE_LENGTH 8
+
+// Number of sends which can be queued (each one takes a pool block).
+// The reserved blocks are left for PtMain, so that a full queue never
+// blocks the commands which would drain it.
+#define TX_QUEUE_LENGTH (POOL_BLOCK_COUNT - POOL_RESERVED_BLOCKS)
+#if TX_QUEUE_LENGTH < 1
+#error "The buffer pool leaves no block for the TX queue"
+#endif
+
+// Encoding of the frames sent with commands #10 and #19 (command #34)
+#define ENCODE_DELTA 1 // Bytes minus those of the previous frame
+#define ENCODE_LZ 2    // LZSS with a static dictionary
+#define ENCODE_HEADER_LENGTH 5 // Flags, original and encoded lengths
+#define ENCODE_FRAME 0x80 // In TxEntryType: the data is an encoded frame
+
+// LZSS matches: 12-bit distance and 4-bit length
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 18
+#define LZ_MAX_DISTANCE 4095
+#define LZ_HASH_SIZE 256 // Heads of the hash chains of 3-byte sequences
+#define LZ_MAX_CHAIN 16  // Earlier occurrences tried at each position
+#define LZ_NONE 0xFFFF   // End of a hash chain
+
+// Size of the header of command #18 (count and remaining bytes)
+#define RX_READ_HEADER_LENGTH 4
+#define RX_OVERFLOW_BIT 0x8000 // In the remaining bytes of command #18
+
+// DHCP lease cache policies
+#define LEASE_CACHE_OFF 0       // Always run a full DHCP exchange
+#define LEASE_CACHE_SAME_BOOT 1 // Reuse leases obtained since the last reboot
+#define LEASE_CACHE_ALWAYS 2    // Also reuse the lease stored at the NVS
+
+// Marks a valid cached DHCP lease
+#define LEASE_VALID_MAGIC 0xA5
+
+// Resolvers queried directly over UDP (command #45). Each query waits
+// twice the smoothed round trip of the slowest server, within limits.
+#define DNS_MAX_SERVERS 2
+#define DNS_CONFIG_MAGIC 0x3D
+#define DNS_PORT 53
+#define DNS_HEADER_LENGTH 12
+#define DNS_QUERY_LENGTH (DNS_HEADER_LENGTH + DNS_NAME_LENGTH + 1 + 4)
+#define DNS_INITIAL_RTT 500 // ms
+#define DNS_MIN_TIMEOUT 200 // ms
+#define DNS_MAX_TIMEOUT 4000 // ms
+
+// Enables the auto-start at boot (command #44)
+#define AUTO_START_MAGIC 0x5C
+
+// Lease lifetime assumed if the host does not give one (seconds)
+#define LEASE_DEFAULT_LIFETIME 3600
+
+// DNS cache: number of entries, max name length and maximum lifetime.
+// Names are cached for the TTL of their record, when it is known (see
+// command #45). Names resolved by the DNS service of the stack have no
+// TTL, and are only reused when pinned: after a warm power cycle, or
+// when they were resolved in advance by the pre-connection.
+#define DNS_CACHE_LENGTH 2
+#define DNS_NAME_LENGTH 64
+#define DNS_CACHE_TTL_MS (5*60*1000UL)
+
+// Parameter of command #11 to power off keeping the warm state
+#define POWER_OFF_WARM 2
+
+// Period of the housekeeping tick, which drives the background jobs.
+// It only runs while one of them needs it (see housekeeping_needed).
+#define HOUSEKEEPING_PERIOD 1000 // ms
+
+// Idle modes (command #29)
+#define IDLE_OFF 0
+#define IDLE_EM1 1 // Sleep in EM1 only
+#define IDLE_EM2 2 // Sleep in EM2 when no timer is due soon
+
+// EM2 is not entered if a timer is due in less than this (ms)
+#define IDLE_EM2_MIN_SLEEP 50
+
+// The microcontroller only sleeps after this time (ms) without mails,
+// so that it does not stop with mails still queued for the task
+#define IDLE_SETTLE_MS 5
+
+// Default scan cache freshness window and background scan interval
+// (seconds, 0 disables)
+#define SCAN_CACHE_DEFAULT_WINDOW 120
+#define SCAN_BACKGROUND_DEFAULT_INTERVAL 0
+
+// Reconnection backoff of the link supervisor (seconds)
+#define SUPERVISOR_MIN_BACKOFF 2
+#define SUPERVISOR_DEFAULT_MAX_BACKOFF 300
+
+// Time given to a TCP reconnection (ms)
+#define SUPERVISOR_TCP_TIMEOUT 10000
+
+// Period of the RSSI sampling while associated (ms)
+#define RSSI_SAMPLE_PERIOD 10000
+
+// Layout of the NVS from NVS_OFFSET(Free): the application data, the
+// HTTP cache and the performance counters, each in a block of fixed size.
+// NVS_LAYOUT_VERSION changes when the blocks move. New fields are only
+// appended to AppDataType, and those which the firmware that wrote the
+// data did not know are reset when it is read.
+#define NVS_LAYOUT_MAGIC 0x4C
+#define NVS_LAYOUT_VERSION 1
+#define NVS_FREE_SIZE 1024 // From NVS_OFFSET(Free) to the end of the NVS
+#define APP_DATA_NVS_SIZE 384
+#define HTTP_CACHE_NVS_SIZE 512
+#define PERF_NVS_SIZE 64
+
+// Conditional HTTP GET cache (commands #32 and #33). The cache is stored
+// at the NVS after the application data.
+#define HTTP_CACHE_MAGIC 0x5A
+#define HTTP_CACHE_BODY_LENGTH 400
+#define HTTP_VALIDATOR_LENGTH 64
+#define HTTP_LINE_LENGTH 128
+#define HTTP_REQUEST_MAX_NAMES 300 // Host and path, together
+#define HTTP_TIMEOUT 10000         // ms
+#define HTTP_CACHE_NVS_OFFSET (NVS_OFFSET(Free) + APP_DATA_NVS_SIZE)
+
+// Validator of the cached document
+#define HTTP_VALIDATOR_NONE 0
+#define HTTP_VALIDATOR_ETAG 1 // Sent back in If-None-Match
+#define HTTP_VALIDATOR_DATE 2 // Last-Modified, sent in If-Modified-Since
+
+// Results of command #32
+#define HTTP_RESULT_NOT_MODIFIED 0 // 304, the cached body is valid
+#define HTTP_RESULT_SAME_BODY 1    // 200 with the body of the cache
+#define HTTP_RESULT_CHANGED 2      // 200 with a new body, now cached
+#define HTTP_RESULT_TOO_LARGE 3    // 200, but the body does not fit
+#define HTTP_RESULT_HTTP_ERROR 4   // Other HTTP status
+#define HTTP_RESULT_FAILED 5       // Not connected, send error or timeout
+#define HTTP_RESULT_CHUNKED 6      // 200 with a chunked body, not supported
+#define HTTP_RESULT_RX_PENDING 7   // Refused, received data is not read yet
+
+// Persistent performance counters (command #41). They are kept at the
+// NVS after the HTTP cache, and written on suspend and every
+// PERF_FLUSH_PERIOD at most.
+#define PERF_MAGIC 0xC5
+#define PERF_FLUSH_PERIOD (60*60*1000UL) // ms
+#define PERF_NVS_OFFSET (HTTP_CACHE_NVS_OFFSET + HTTP_CACHE_NVS_SIZE)
+#define PERF_COUNT(counter, n) do { perf.counter += (n); \
+                                    perf_dirty = TRUE; } while (0)
+
+// FNV-1a hash of the document bodies
+#define FNV_OFFSET_BASIS 2166136261UL
+#define FNV_PRIME 16777619UL
+
+// Framed SPI protocol (command #36). A frame is a header of
+// FRAME_HEADER_LENGTH bytes (opcode, flags, payload length as rsuint16),
+// followed by the payload and its CRC16-CCITT in a second transfer.
+#define FRAME_HEADER_LENGTH 4
+#define FRAME_CRC_LENGTH 2
+#define FRAME_MAX_PAYLOAD (POOL_BLOCK_SIZE - FRAME_CRC_LENGTH)
+#define FRAME_LAST_COMMAND 45
+
+// Status byte sent back for each frame, before the response
+#define FRAME_OK 0
+#define FRAME_BAD_CRC 1
+#define FRAME_BAD_LAYOUT 2 // Unknown opcode or wrong payload length
+#define FRAME_TOO_LONG 3
+#define FRAME_DUPLICATE 4 // Already executed, response not cached
+
+// Link layer: the flags byte of a frame header is its sequence number
+// (0 if none). Responses of sequenced frames are cached so that they can
+// be sent again without executing the command twice.
+#define LINK_CACHE_LENGTH 4
+#define LINK_RESPONSE_LENGTH 32
+
+// Sends a response to the host, and keeps a copy of it for the link
+// layer
+#define SPI_WRITE(pt, data, len) do { \
+    link_capture((const rsuint8*)(data), (len)); \
+    DrvSpiTxStart((rsuint8*)(data), (len)); \
+    PT_WAIT_UNTIL((pt), IS_RECEIVED(SPI_TX_DONE)); \
+  } while (0)
+
+// Reads the next argument of an SPI command: from the frame payload in
+// framed mode, or with its own SPI transfer otherwise
+#define SPI_READ(pt, dest, len) do { \
+    if (frame_buffer != NULL) \
+      frame_read((rsuint8*)(dest), (len)); \
+    else { \
+      DrvSpiRx((rsuint8*)(dest), (len)); \
+      PT_WAIT_UNTIL((pt), IS_RECEIVED(SPI_RX_DATA)); \
+    } \
+  } while (0)
+
+// Fault injection. FAULT_DELAY waits the given ms before a network
+// operation, and FAULT_ROLL is true with the given percentage.
+#ifdef FAULT_INJECTION
+#define FAULT_DELAY(pt, ms) do { \
+    if ((ms) > 0) \
+      PT_DELAY((pt), (ms)); \
+  } while (0)
+#define FAULT_ROLL(pct) fault_roll(pct)
+#else
+#define FAULT_DELAY(pt, ms)
+#define FAULT_ROLL(pct) FALSE
+#endif
+
+// Deferred sends (commands #39 and #40). A deferred send waits for a
+// good link until its deadline: RSSI at least DEFER_DEFAULT_RSSI dBm and
+// DEFER_DEFAULT_SUCCESSES of the last 8 sends successful.
+#define DEFER_DEFAULT_RSSI -80
+#define DEFER_DEFAULT_SUCCESSES 6
+#define DEFER_DEFAULT_PROBE 30 // s between link probes while suspended
+#define DEFER_AUTO_SUSPEND 1   // Flag: suspend the radio between probes
+#define DEFER_RSSI_TIMEOUT 2000 // ms
+
+// SNTP client (commands #42 and #43). The time is kept between syncs
+// with the system ticks, which run from the RTC through suspend and are
+// corrected by the hourly LFRCO calibration.
+#define SNTP_DEFAULT_SERVER "pool.ntp.org"
+#define SNTP_PORT 123
+#define SNTP_PACKET_LENGTH 48
+#define SNTP_UNIX_OFFSET 2208988800UL // Seconds from 1900 to 1970
+#define SNTP_TIMEOUT 3000             // ms
+#define SNTP_RETRY (60*1000UL)        // ms after a failed sync
+#define SNTP_DEFAULT_PERIOD 360       // Minutes between syncs
+#define SNTP_AUTO 1     // Flag: sync after connecting, and periodically
+#define SNTP_SYNC_NOW 2 // Flag: sync once now
+
+// Queued sends (commands #19 and #39) are stamped by replacing the first
+// TIME_MARKER with the Unix time in decimal, 0 if the time is unknown
+#define TIME_MARKER "@@@@@@@@@@"
+#define TIME_MARKER_LENGTH 10
+
+// WPA pre-shared key. The PMK is derived from the passphrase once, when
+// the AP is set up, with PBKDF2-HMAC-SHA1, and stored as 64 hex digits.
+#define PMK_LENGTH 32
+#define PMK_ITERATIONS 4096
+#define PMK_CHUNK 256 // Iterations between yields
+#define SHA1_LENGTH 20
+#define SHA1_BLOCK_LENGTH 64
+
+// Terminal benchmark ("bench <cycle> <n> [name]")
+#define BENCH_MAX_ITERATIONS 64
+#define BENCH_TIMEOUT 15000 // ms, for each wait of an iteration
+
+// Milliseconds elapsed since boot
+#define UPTIME_MS() (RosGetSystemTicks() / RS_T1MS)
+
+// True once the uptime t (in ms) has been reached
+#define TIME_REACHED(t) ((rsint32)(UPTIME_MS() - (t)) >= 0)
+
+// Waits until a condition is true or the uptime t is reached. The
+// packet delay timer is armed for t, so the wait ends even if no other
+// mail arrives.
+#define PT_WAIT_UNTIL_TIME(pt, cond, t) \
+  PT_WAIT_UNTIL((pt), (cond) || TIME_REACHED(t) || (timer_request(t), FALSE))
+
+// True while the housekeeping tick is dispatched
+#define HOUSEKEEPING_TICK \
+  (IS_RECEIVED(APP_PACKET_DELAY_TIMEOUT) && housekeeping_ticked)
+
+// Waits the given ms. Each use keeps its own deadline.
+#define PT_DELAY(pt, ms) do { \
+    static rsuint32 delay_due; \
+    delay_due = UPTIME_MS() + (ms); \
+    PT_WAIT_UNTIL_TIME((pt), FALSE, delay_due); \
+  } while (0)
+
 /****************************************************************************
 *                     Enumerations/Type definitions/Structs
 ****************************************************************************/
+// Cached DHCP lease
+typedef struct {
+  rsuint8 valid; // LEASE_VALID_MAGIC if the lease can be used
+  rsuint32 address, subnet, gateway, dns;
+  rsuint32 lifetime; // Lease lifetime in seconds
+  rsuint32 obtained; // Unix time when it was obtained, 0 if unknown
+} DhcpLeaseType;
+
 // Application data stored at the NVS
 typedef struct {
+  // Fields of the first firmware, which had no layout header
   ApInfoType ap_info;
   rsuint8 use_dhcp;
   ApiSocketAddrType static_address, static_subnet, static_gateway;
+  // Layout header. The fields which follow are reset if it is not valid.
+  rsuint8 layout_magic;   // NVS_LAYOUT_MAGIC
+  rsuint8 layout_version; // NVS_LAYOUT_VERSION
+  rsuint16 layout_size;   // sizeof(AppDataType) of the writer
+  DhcpLeaseType lease;
+  rsuint8 lease_policy;    // LEASE_CACHE_*
+  rsuint32 lease_lifetime; // Lifetime given to new leases, in seconds
+  rsuint8 auto_start;      // AUTO_START_MAGIC: connect to the AP at boot
+  rsuint8 dns_config;      // DNS_CONFIG_MAGIC if dns_servers is set
+  rsuint32 dns_servers[DNS_MAX_SERVERS]; // 0: unused
+  rsuint8 key_is_pmk;      // ap_info.Key is the PMK, not the passphrase
 } AppDataType;
 
+// Fails to compile if a block outgrows its room at the NVS
+typedef char AppDataFitsNvs[sizeof(AppDataType) <= APP_DATA_NVS_SIZE ? 1 : -1];
+
+// SHA-1 state
+typedef struct {
+  rsuint32 h[5];
+  rsuint32 length; // Bytes hashed
+  rsuint8 block[SHA1_BLOCK_LENGTH];
+} Sha1Type;
+
+// PBKDF2 state, kept across the yields of PtWifi_derive_PMK
+typedef struct {
+  Sha1Type inner, outer; // HMAC pads already hashed
+  rsuint8 u[SHA1_LENGTH], t[SHA1_LENGTH];
+  rsuint8 pmk[2 * SHA1_LENGTH];
+  rsuint16 iteration;
+  rsuint8 block;
+} PmkStateType;
+
+// Receive buffer owned by the socket stack, freed once read
+typedef struct {
+  int handle;      // Socket which received the buffer
+  rsuint8 *ptr;
+  rsuint16 length;
+} RxBufferType;
+
+// Send waiting in the TX queue
+typedef struct {
+  rsuint8 seq;     // Sequence number, never 0
+  rsuint16 length;
+  rsuint8 *data;   // Pool block
+  rsbool deferred; // Wait for a good link until the deadline
+  rsuint32 deadline; // Uptime, in ms
+  int socket;      // TCP socket when it was queued
+  rsuint32 id;     // Unlike seq, it does not wrap in practice
+  rsuint8 encoding; // ENCODE_FRAME and the flags of the frame, or 0
+} TxEntryType;
+
+// Resolved DNS name
+typedef struct {
+  rsuint8 name[DNS_NAME_LENGTH];
+  rsuint32 ip;       // 0 if the entry is empty
+  rsuint32 time;     // Uptime of the resolution, in ms
+  rsuint32 lifetime; // From the record TTL, in ms. 0 if unknown.
+  rsbool pinned;     // Reusable even if the lifetime is unknown
+} DnsCacheEntryType;
+
+// Association state kept across a warm power cycle. The AP profile and
+// the IP lease are kept in app_data, and the DNS cache in dns_cache.
+typedef struct {
+  rsbool valid;
+  rsbool associated;    // Associated to the AP before the power off
+  rsbool tcp_connected; // TCP session open before the power off
+  ApiSocketAddrType tcp_target;
+  rsuint8 power_save_profile, tx_power;
+} WarmStateType;
+
+#ifdef FAULT_INJECTION
+// Network faults to inject (command #38)
+typedef struct {
+  rsuint8 dns_fail;        // Percentage of DNS resolutions which fail
+  rsuint8 send_drop;       // Percentage of sends which fail
+  rsuint16 dns_delay;      // Delays added, in ms
+  rsuint16 assoc_delay;
+  rsuint16 tcp_delay;
+  rsuint16 disconnect;     // Close the TCP session every N s (0: never)
+  rsuint16 seed;           // Seed of the pseudo-random faults
+} FaultConfigType;
+#endif
+
+// Response of a sequenced frame, kept by the link layer
+typedef struct {
+  rsuint8 seq;       // 0 if the entry is free
+  rsuint8 command;
+  rsuint16 crc;      // CRC of the frame, to tell retries from new frames
+  rsbool truncated;  // The response did not fit
+  rsuint8 length;
+  rsuint8 data[LINK_RESPONSE_LENGTH];
+} LinkRecordType;
+
+// Header of the HTTP cache at the NVS. The body follows it.
+typedef struct {
+  rsuint8 valid; // HTTP_CACHE_MAGIC if the cache holds a document
+  rsuint8 validator_type; // HTTP_VALIDATOR_*
+  rsuint8 validator[HTTP_VALIDATOR_LENGTH];
+  rsuint16 length;
+  rsuint32 hash; // FNV-1a of the body
+} HttpCacheHeaderType;
+
+typedef char HttpCacheFitsNvs[sizeof(HttpCacheHeaderType) +
+                              HTTP_CACHE_BODY_LENGTH <= HTTP_CACHE_NVS_SIZE ?
+                              1 : -1];
+
+// Cumulative performance counters, kept across reboots
+typedef struct {
+  rsuint8 valid; // PERF_MAGIC
+  rsuint16 boots;
+  rsuint16 wifi_connects;
+  rsuint16 wifi_failures;  // Failed associations
+  rsuint16 tcp_connects;
+  rsuint16 link_losses;    // Outages detected by the supervisor
+  rsuint16 dns_failures;   // Failed or timed out resolutions
+  rsuint16 send_failures;  // Failed API_SOCKET_SEND_CFM
+  rsuint32 bytes_sent;
+  rsuint32 bytes_received;
+  rsuint32 suspended_time; // s
+  rsuint32 uptime;         // s
+} PerfCountersType;
+
+typedef char PerfFitsNvs[sizeof(PerfCountersType) <= PERF_NVS_SIZE ? 1 : -1];
+typedef char NvsLayoutFits[PERF_NVS_OFFSET + PERF_NVS_SIZE <=
+                           NVS_OFFSET(Free) + NVS_FREE_SIZE ? 1 : -1];
+
+// States of the HTTP response parser
+typedef enum {
+  HTTP_PARSE_STATUS,
+  HTTP_PARSE_HEADERS,
+  HTTP_PARSE_BODY,
+  HTTP_PARSE_DONE
+} HttpParseStateType;
+
+// HTTP response parser
+typedef struct {
+  HttpParseStateType state;
+  rsuint16 status;
+  rsbool has_length;
+  rsbool chunked;
+  rsuint32 content_length;
+  rsuint32 body_length;
+  rsuint32 hash;
+  rsuint8 line[HTTP_LINE_LENGTH];
+  rsuint8 line_length;
+  rsuint8 validator_type;
+  rsuint8 validator[HTTP_VALIDATOR_LENGTH];
+} HttpParserType;
+
+// Outcome of a conditional HTTP GET
+typedef struct {
+  rsuint8 result;  // HTTP_RESULT_*
+  rsuint16 status; // HTTP status code, 0 if no response
+  rsuint16 length; // Body length
+  rsuint32 hash;
+} HttpResultType;
+
+// Server to which the host uploads its data (command #31)
+typedef struct {
+  rsbool preconnect;  // Connect to it on resume, before the host asks
+  rsuint16 port;      // As given to command #4
+  rsuint8 name[DNS_NAME_LENGTH];
+} UploadTargetType;
+
+// Result of the last scan
+typedef struct {
+  rsbool valid;
+  rsbool ap_available; // The configured AP was found
+  rsuint8 ssid[33];    // SSID of the configured AP at the time of the scan
+  rsuint32 profile;    // ap_profile_hash() at the time of the scan
+  rsuint32 time;       // Uptime of the scan, in ms
+} ScanCacheType;
+
+// Link outages handled by the supervisor (durations in ms)
+typedef struct {
+  rsuint16 count;    // Outages recovered
+  rsuint16 attempts; // Reconnection attempts
+  rsuint32 last, max, total;
+} OutageStatsType;
+
+// Tokenised log messages. The format strings are in LogFormats[], in
+// the same order, and are expanded when the log is flushed.
+typedef enum {
+  LOG_BOOT,
+  LOG_LEASE_RESTORED,
+  LOG_LEASE_DROPPED,
+  LOG_DHCP_STARTED,
+  LOG_SCAN_CACHED,
+  LOG_AP_NOT_AVAILABLE,
+  LOG_CONNECT_FAILED,
+  LOG_DNS_RESOLVED,
+  LOG_DNS_FAILED,
+  LOG_DNS_TIMEOUT,
+  LOG_TCP_CONNECTED,
+  LOG_SOCKET_CLOSED,
+  LOG_SEND_DONE,
+  LOG_RX_DATA,
+  LOG_RX_OVERFLOW,
+  LOG_WARM_RESTORE,
+  LOG_LINK_LOST,
+  LOG_LINK_RECOVERED,
+  LOG_PRECONNECT,
+  LOG_TIME_SYNCED,
+  LOG_TIME_FAILED,
+  LOG_AUTO_START,
+  LOG_AP_CONFIG_FAILED,
+  LOG_AP_CONFIG,
+  LOG_AP_UNKNOWN_CIPHER,
+  LOG_AP_FROM_NVS,
+  LOG_AP_DISCONNECTED,
+  LOG_SCAN_STARTED,
+  LOG_ASSOCIATING,
+  LOG_IP_FROM_NVS,
+  LOG_STATIC_IP,
+  LOG_TCP_START_FAILED,
+  LOG_SEND_QUEUED,
+  LOG_WIFI_POWER,
+  LOG_MSG_COUNT
+} LogMsgType;
+
+// Log record
+typedef struct {
+  rsuint32 time; // Uptime in ms
+  rsuint8 level;
+  rsuint8 msg;   // LogMsgType
+  rsuint32 arg[2];
+} LogRecordType;
+
+// States whose time and charge are accounted by the energy estimator.
+// The radio and the MCU are each in one of their states at any time.
+typedef enum {
+  ENERGY_RADIO_OFF,
+  ENERGY_RADIO_SLEEP,       // Suspended
+  ENERGY_RADIO_IDLE_LOW,    // Powered, by powersave profile (command #12)
+  ENERGY_RADIO_IDLE_MEDIUM,
+  ENERGY_RADIO_IDLE_HIGH,
+  ENERGY_RADIO_IDLE_MAX,
+  ENERGY_RADIO_SCAN,        // Scan phase
+  ENERGY_RADIO_CONNECT,     // Associate, DHCP, DNS and TCP connect phases
+  ENERGY_RADIO_TX,          // Send in progress, at full transmit power
+  ENERGY_MCU_EM1,
+  ENERGY_MCU_EM2,
+  ENERGY_STATE_COUNT
+} EnergyStateType;
+
+// Connection phases timed by the profiler
+typedef enum {
+  PHASE_SCAN,        // PtAppWifiScan
+  PHASE_ASSOCIATE,   // Association, including the WPA handshake
+  PHASE_DHCP,        // Until APP_EVENT_IP_ADDR_RECEIVED
+  PHASE_DNS,         // DNS resolution
+  PHASE_TCP_CONNECT, // Until PtWifi_TCP_on_connect fires
+  PHASE_COUNT
+} ConnPhaseType;
+
+// Timing statistics of a connection phase (in ms)
+typedef struct {
+  rsbool running;  // True while the phase is being timed
+  rsuint32 start;  // Start time of the running phase
+  rsuint16 count;  // Number of completed phases
+  rsuint32 last, min, max, total;
+} PhaseStatsType;
+
 
 /****************************************************************************
 *                            Global variables/const
@@ -106,16 +679,296 @@ static const RosTimerConfigType DnsRspTimer =
   ROSTIMER(COLA_TASK, APP_DNS_RSP_TIMEOUT,
   APP_DNS_RSP_TIMER);
 
+// The packet delay timer is shared by all the waits with a deadline and
+// the housekeeping tick, and armed for the earliest one
+static rsbool timer_armed;
+static rsuint32 timer_due; // Uptime, in ms
+
+// True while a protothread uses the WiFi chip. The background jobs only
+// run when it is free, and PtMain waits for them to finish.
+static rsbool radio_busy;
+
 // TCP flags
 static char TCP_is_connected; // True when the TCP connection has been stablished
 static char TCP_received; // True when data has been received at the TCP connection
 
 static int socketHandle; // The socket ID of the TCP connection
-static rsuint8 *TCP_receive_buffer_ptr; // TCP receive buffer
-static int TCP_Rx_bufferLength; // Number of bytes received at the TCP buffer
+static ApiSocketAddrType tcp_target; // Server of the last TCP connection
+
+// Framed SPI protocol
+static rsbool framed_mode;
+static rsuint8 *frame_buffer;  // Payload of the current frame, or NULL
+static rsuint16 frame_length, frame_pos;
+
+// Argument layout of each SPI command, from command #1, used to check
+// the payload of the frames. '1', '2' and '4' are fields of that many
+// bytes, 's' is a size byte followed by that many bytes, and 'S' the
+// same with an rsuint16 size.
+static const char * const CommandLayouts[FRAME_LAST_COMMAND] = {
+  "",     "s",    "s",    "42",   "",     "",     "s",    "",     // 1-8
+  "",     "S",    "1",    "1",    "1",    "",     "",     "1",    // 9-16
+  "14",   "2",    "S",    "",     "",     "22",   "12",   "",     // 17-24
+  "",     "",     "1",
+  "244444444444", // 28: battery and ENERGY_STATE_COUNT currents
+  "1",    "1",    "12s",  "ss",   "",     "1",    "1",    "1",    // 29-36
+  "1",                                                            // 37
+  #ifdef FAULT_INJECTION
+  "1122222",
+  #else
+  NULL, // 38: not available
+  #endif
+  "2S",   "1121", "1",    "",     "12s",  "1",    "44"            // 39-45
+};
+
+#ifdef FAULT_INJECTION
+// Fault injection
+static FaultConfigType fault_config;
+static rsuint32 fault_random = 1;
+static rsuint32 fault_last_disconnect; // Uptime, in ms
+static rsuint16 fault_count[3]; // DNS failures, dropped sends, disconnects
+#endif
+
+// Link layer response cache
+static LinkRecordType link_cache[LINK_CACHE_LENGTH];
+static rsuint8 link_next;              // Entry to reuse next
+static LinkRecordType *link_record;    // Entry of the current command
+
+// Frame encoder
+static rsuint8 encode_mode;
+static rsuint8 encode_prev[TX_BUFFER_LENGTH]; // Last frame, not encoded
+static rsuint16 encode_prev_length;           // 0 after a new connection
+static rsbool encode_base_lost; // An encoded frame was not delivered
+static rsuint32 encode_frames, encode_bytes_in, encode_bytes_out;
+static rsuint32 encode_cycles;
+
+// Static dictionary which precedes the LZSS window. It holds the keys
+// and separators of the sensor frames.
+static const rsuint8 LzDictionary[] =
+  "{\"timestamp\":\"\",\"temp\":\"hum\":\"light\":\"bat\":\"panel\":"
+  "\"co\":\"no2\":\"noise\":\"nets\":\"value\":0.00,\"}";
+#define LZ_DICTIONARY_LENGTH (sizeof(LzDictionary) - 1)
+#define LZ_WINDOW_LENGTH (LZ_DICTIONARY_LENGTH + TX_BUFFER_LENGTH)
+
+// Delta of the frame being encoded, and hash chains of the LZSS window:
+// the last position of each hash, and the previous one of each position.
+// They are static, so that encoding never competes for pool blocks.
+static rsuint8 encode_scratch[TX_BUFFER_LENGTH];
+static rsuint16 lz_head[LZ_HASH_SIZE];
+static rsuint16 lz_prev[LZ_WINDOW_LENGTH];
+
+// Conditional HTTP GET
+static HttpCacheHeaderType http_cache;
+static HttpParserType http_parser;
+
+// Upload target, and pre-connection requested by PtWifi_resume
+static UploadTargetType upload_target;
+static rsbool preconnect_pending;
+static int TCP_Rx_bufferLength; // Number of bytes read by the last receive
+
+// Received data not read yet. The head buffer is read from rx_offset.
+static RxBufferType rx_queue[RX_QUEUE_LENGTH];
+static rsuint8 rx_queue_head, rx_queue_count;
+static rsuint16 rx_offset;
+static rsuint16 rx_pending; // Bytes not read yet
+static rsbool rx_overflow;  // Data was lost since the queue was flushed
+
+// Sends not confirmed yet. Only the head is given to the socket.
+static TxEntryType tx_queue[TX_QUEUE_LENGTH];
+static rsuint8 tx_queue_head, tx_queue_count;
+static rsbool tx_in_flight;   // The head waits for API_SOCKET_SEND_CFM
+static rsuint8 tx_next_seq = 1;
+static rsuint8 tx_done_seq;   // Last completed send
+static rsuint8 tx_failed_seq; // Last failed send
+static rsuint32 tx_last_id;   // Id of the last queued send
+static rsuint32 tx_failed_id; // Id of the last failed send
+static rsuint16 tx_failures;  // Number of failed sends
+static rsuint8 tx_history = 0xff; // Results of the last 8 sends, 1: OK
+
+// Deferred sends
+static rsint8 defer_rssi = DEFER_DEFAULT_RSSI;
+static rsuint8 defer_successes = DEFER_DEFAULT_SUCCESSES;
+static rsuint16 defer_probe = DEFER_DEFAULT_PROBE;
+static rsuint8 defer_flags = DEFER_AUTO_SUSPEND;
+static rsuint16 defer_stats[4]; // Deferred, sent on a good link, sent
+                                // at the deadline, probes
+static rsbool radio_wanted;     // PtMain waits for radio_busy
+
+// UDP clients (SNTP and DNS), one at a time. API_SOCKET_CREATE_CFM
+// does not tell which request it confirms, so a client owns udp_busy
+// from before its create request until it closes the socket, and no two
+// UDP creations are ever pending.
+static int udp_socket;
+static rsbool udp_busy;         // A client owns udp_socket
+static rsbool udp_waiting;      // A client waits for a datagram
+
+// Resolvers queried over UDP
+static rsuint16 dns_rtt[DNS_MAX_SERVERS] = {DNS_INITIAL_RTT, DNS_INITIAL_RTT};
+static rsuint16 dns_wins[DNS_MAX_SERVERS]; // First answers
+static rsuint8 dns_query[DNS_QUERY_LENGTH];
+static rsuint32 dns_race_address;  // Result of PtDns_race
+static rsbool dns_race_answered;   // A resolver answered, even with an error
+static rsuint32 dns_race_ttl;      // TTL of the winning record, in s
+
+// PMK derivation
+static PmkStateType pmk_state;
+
+// Boot
+static rsbool booting;              // PtBoot has not finished yet
+static rsuint32 boot_connected_time; // Uptime of the first association, ms
+
+// SNTP client
+static rsuint8 sntp_server[DNS_NAME_LENGTH] = SNTP_DEFAULT_SERVER;
+static rsuint8 sntp_flags = SNTP_AUTO;
+static rsuint16 sntp_period = SNTP_DEFAULT_PERIOD;
+static rsbool sntp_pending;     // PtSntp must sync
+static rsuint32 sntp_next;      // Uptime of the next sync, 0 if none
+static rsuint8 sntp_packet[SNTP_PACKET_LENGTH];
+static rsbool time_synced;
+static rsuint32 time_base;        // Unix time of the last sync, in s
+static rsuint16 time_base_ms;     // and its milliseconds
+static rsuint32 time_base_uptime; // Uptime of the last sync, in ms
+static rsuint16 time_rtt;         // Round trip of the last sync, in ms
+
+// Link metrics
+static rsint8 wifi_rssi;         // Last RSSI sample, in dBm
+static rsuint32 wifi_rssi_time;  // Uptime of the last RSSI request
+static rsuint8 last_send_status; // Status of the last API_SOCKET_SEND_CFM
+static rsuint8 last_dns_status;  // Status of the last DNS resolution
+static rsuint32 bytes_sent, bytes_received;
+
+// Persistent performance counters
+static PerfCountersType perf;
+static rsbool perf_dirty;      // Changed since the last NVS write
+static rsuint32 perf_flush_time; // Uptime of the last NVS write, in ms
+static rsuint32 perf_uptime_mark; // Uptime already counted, in ms
+static rsuint32 suspend_start;    // Uptime, in ms
 
 // Energy control
 static rsuint8 is_suspended;
+static rsuint8 wifi_power_save_profile = 3; // Set by Wifi_set_power_save_profile
+static rsuint8 wifi_tx_power = MAX_TX_POWER;
+
+// Idle manager
+static rsuint8 idle_mode = IDLE_OFF;
+static rsbool spi_waiting_command; // PtMain waits for a command byte
+static rsbool housekeeping_running;
+static rsuint32 housekeeping_due;  // Uptime of the next tick, in ms
+static rsbool housekeeping_ticked; // The mail being dispatched is a tick
+static rsuint32 idle_mails;        // Mails handled by ColaTask
+static rsuint32 idle_settle_mails; // idle_mails when the settle started
+static rsuint32 idle_settle_due;   // Uptime, in ms
+static rsbool idle_settling;
+static rsuint32 idle_entries[2];   // EM1 and EM2
+static rsuint32 idle_time[2];      // ms
+
+// Energy estimator
+static rsbool wifi_powered;
+static rsbool mcu_in_em2;
+static rsuint32 energy_state_time[ENERGY_STATE_COUNT]; // ms
+static rsuint8 energy_radio_state = ENERGY_RADIO_OFF;
+static rsuint8 energy_mcu_state = ENERGY_MCU_EM1;
+static rsuint32 energy_last_update; // Uptime, in ms
+static rsuint32 energy_charge_mc;   // Charge used, in mC...
+static rsuint32 energy_charge_uc;   // ...plus this remainder in uC
+static rsuint32 energy_uploads;     // Successful sends
+static rsuint16 energy_battery = ENERGY_DEFAULT_BATTERY; // mAh
+// Supply current of each state, in uA. Rough figures to be calibrated
+// with command #28 against measurements of the actual board.
+static rsuint32 energy_current[ENERGY_STATE_COUNT] = {
+  5,      // ENERGY_RADIO_OFF
+  60,     // ENERGY_RADIO_SLEEP
+  1500,   // ENERGY_RADIO_IDLE_LOW
+  5000,   // ENERGY_RADIO_IDLE_MEDIUM
+  20000,  // ENERGY_RADIO_IDLE_HIGH
+  80000,  // ENERGY_RADIO_IDLE_MAX
+  120000, // ENERGY_RADIO_SCAN
+  100000, // ENERGY_RADIO_CONNECT
+  250000, // ENERGY_RADIO_TX
+  3000,   // ENERGY_MCU_EM1
+  2       // ENERGY_MCU_EM2
+};
+
+// Warm power cycle
+static WarmStateType warm_state;
+
+// Resolved DNS names
+static DnsCacheEntryType dns_cache[DNS_CACHE_LENGTH];
+
+// Link supervisor
+static rsbool supervisor_enabled;
+static rsbool supervisor_tcp; // Also reopen the TCP sessions closed by the server
+static rsuint16 supervisor_max_backoff = SUPERVISOR_DEFAULT_MAX_BACKOFF;
+static rsbool wifi_wanted; // Associated on request of the host
+static rsbool tcp_wanted;  // TCP session opened on request of the host
+static rsbool in_outage;
+static OutageStatsType outage_stats;
+
+// Scan cache and background scan
+static ScanCacheType scan_cache;
+static rsuint16 scan_cache_window = SCAN_CACHE_DEFAULT_WINDOW;
+static rsuint16 scan_background_interval = SCAN_BACKGROUND_DEFAULT_INTERVAL;
+
+// Log ring
+static LogRecordType log_ring[LOG_RING_LENGTH];
+static rsuint8 log_head, log_count;
+static rsuint16 log_dropped; // Records overwritten before being read
+
+#ifdef USE_LUART_TERMINAL
+// Format strings of the log messages, indexed by LogMsgType. Host tools
+// expanding the records read with command #26 use this same table.
+static const char * const LogFormats[LOG_MSG_COUNT] = {
+  "Boot",
+  "Restore cached DHCP lease %08lx",
+  "Cached DHCP lease dropped",
+  "Do DHCP",
+  "Using cached scan, age %lu ms",
+  "AP not available",
+  "Unable to connect",
+  "DNS response: %08lx",
+  "DNS failed, status %lu",
+  "No response from DNS client",
+  "TCP connected, socket %lu",
+  "Socket closed",
+  "Send %lu done, status %lu",
+  "Received %lu bytes",
+  "RX queue full, %lu bytes lost",
+  "Restoring warm state",
+  "Supervisor: link lost",
+  "Supervisor: link recovered after %lu ms",
+  "Pre-connecting to %08lx",
+  "Time synced: %lu, RTT %lu ms",
+  "Time sync failed, status %lu",
+  "Auto-start, connected: %lu",
+  "AP config not parsed, no free buffer",
+  "AP config: security %lu, cipher %lu",
+  "Unknown cipher, default kept",
+  "Using the AP config of the NVS",
+  "Disconnected from the old AP",
+  "Scanning",
+  "AP available, associating",
+  "IP config read from NVS",
+  "Static IP %08lx, gateway %08lx",
+  "TCP connection failed after %lu ms",
+  "Send %lu queued, %lu bytes",
+  "WiFi power %lu"
+};
+#endif
+
+// Connection phase profiler
+static PhaseStatsType phase_stats[PHASE_COUNT];
+
+// DHCP lease cache
+static rsuint32 lease_obtained_ms; // Uptime when the lease was obtained
+static rsbool lease_in_use; // True if the IP config comes from the cache
+static rsbool lease_warm; // Restoring a warm power cycle: ignore the policy
+static rsuint32 dhcp_acquired_ms;   // Uptime of the last DHCP exchange, or 0
+static rsuint32 dhcp_acquired_time; // Its Unix time, 0 if unknown
+
+// Buffer pool
+static rsuint8 pool_blocks[POOL_BLOCK_COUNT][POOL_BLOCK_SIZE];
+static rsbool pool_used[POOL_BLOCK_COUNT];
+static rsuint8 pool_in_use, pool_high_water;
+static rsuint16 pool_failures; // Requests which found no free block
 
 
 /****************************************************************************
@@ -133,10 +986,6 @@ rsuint16 argc;
 char *argv[MAX_ARGV];
 #endif  
 
-// TCP send/receive/ buffers
-rsuint8 tx_buffer[TX_BUFFER_LENGTH];
-rsuint8 rx_buffer[TX_BUFFER_LENGTH];
-
 
 /****************************************************************************
 *                                Implementation
@@ -310,273 +1159,1756 @@ int extract_substring(rsuint8 *dest, rsuint8 *orig, int orig_ptr) {
 }
 
 /**
- * @brief Saves the application info object contents to NVS
+ * @brief Writes a 16-bit word in little-endian order
+ * @param p : destination pointer
+ * @param value : value to write
+ * @return pointer to the byte after the written value
  **/
-void Wifi_save_appInfo_to_NVS() {
-  NvsWrite(NVS_OFFSET(Free),
-           sizeof(AppDataType),
-           (rsuint8*)&app_data);
+static rsuint8 *put_u16(rsuint8 *p, rsuint16 value) {
+  *p++ = (rsuint8)(value & 0xff);
+  *p++ = (rsuint8)(value >> 8);
+  return p;
 }
 
 /**
- * @brief Retrieves the application info object contents to NVS
+ * @brief Writes a 32-bit word in little-endian order
+ * @param p : destination pointer
+ * @param value : value to write
+ * @return pointer to the byte after the written value
  **/
-void Wifi_read_appInfo_from_NVS() {
-  NvsRead(NVS_OFFSET(Free),
-          sizeof(AppDataType),
-          (rsuint8 *)&app_data);
+static rsuint8 *put_u32(rsuint8 *p, rsuint32 value) {
+  p = put_u16(p, (rsuint16)(value & 0xffff));
+  return put_u16(p, (rsuint16)(value >> 16));
 }
 
 /**
- * @brief Fulfills an ApInfoType object from a string
- * @param ap_data : input string
- * @param ap_info : AP info object to fulfill
+ * @brief Appends a record to the log ring, overwriting the oldest one
+ * if it is full. Use the LOG_* macros instead.
+ * @param level : LOG_LEVEL_*
+ * @param msg : message token
+ * @param a, b : arguments of the message
  **/
-void get_ap_info_from_str(rsuint8 *ap_data, ApInfoType *ap_info) {
-  int ap_ptr = 0;
-  
-  ap_info->KeyIndex = 0;
-
-  // Extract SSID
-  ap_ptr = extract_substring(ap_info->Ssid, ap_data, ap_ptr);
-  ap_info->SsidLength = (rsuint8)strlen((char*)ap_info->Ssid);
-  #ifdef USE_LUART_TERMINAL
-  sprintf(TmpStr, "SSID=%s, ssid_len=%d", ap_info->Ssid, ap_info->SsidLength); PRINTLN(TmpStr);
-  #endif
+static void log_write(rsuint8 level, LogMsgType msg, rsuint32 a, rsuint32 b) {
+  LogRecordType *record;
 
-  // Extract encryption algorithm
-  rsuint8 securityType_str[100];
-  ap_ptr = extract_substring(securityType_str, ap_data, ap_ptr);
-  #ifdef USE_LUART_TERMINAL
-  sprintf(TmpStr, "Encryption=%s", securityType_str); PRINTLN(TmpStr);  
-  #endif
+  if (log_count == LOG_RING_LENGTH) {
+    log_head = (log_head + 1) % LOG_RING_LENGTH;
+    log_count--;
+    log_dropped++;
+  }
+  record = &log_ring[(log_head + log_count) % LOG_RING_LENGTH];
+  record->time = UPTIME_MS();
+  record->level = level;
+  record->msg = (rsuint8)msg;
+  record->arg[0] = a;
+  record->arg[1] = b;
+  log_count++;
+}
 
-  // Extract key
-  ap_ptr = extract_substring(ap_info->Key, ap_data, ap_ptr);
-  #ifdef USE_LUART_TERMINAL
-  sprintf(TmpStr, "key=%s", ap_info->Key); PRINTLN(TmpStr);
-  #endif
-  //
-  ap_info->KeyLength = (rsuint8)strlen((char*)ap_info->Key);
+/**
+ * @brief Removes the oldest record from the log ring
+ * @return the record, or NULL if the log is empty. It is valid until
+ * the next log_write.
+ **/
+static LogRecordType *log_read(void) {
+  LogRecordType *record;
+
+  if (log_count == 0)
+    return NULL;
+  record = &log_ring[log_head];
+  log_head = (log_head + 1) % LOG_RING_LENGTH;
+  log_count--;
+  return record;
+}
 
-  // Set securityType and cipher according to securityType_str
-  ap_info->SecurityType = AWST_NONE; // Just to prevent the warning
-  if (!strcasecmp((char*)securityType_str, "WPA")) {
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Set WPA");
-    #endif
-    ap_info->SecurityType = AWST_WPA;
-    ap_info->Mcipher = AWCT_TKIP; 
-    ap_info->Ucipher = AWCT_TKIP;
-  }
-  else if (!strcasecmp((char*)securityType_str, "WPA2")) {
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Set WPA2");
-    #endif
-    ap_info->SecurityType = AWST_WPA2;
-    ap_info->Mcipher = AWCT_CCMP; 
-    ap_info->Ucipher = AWCT_CCMP;
-  }
-  else if (!strcasecmp((char*)securityType_str, "NONE")) {
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Set encryption NONE");
-    #endif
-    ap_info->SecurityType = AWST_NONE;
+/**
+ * @brief Moves log records to a buffer, in binary form (see command #26)
+ * @param buffer : output buffer
+ * @param max_len : size of the buffer
+ * @return number of bytes written
+ **/
+static rsuint16 log_serialize(rsuint8 *buffer, rsuint16 max_len) {
+  rsuint8 *p = buffer + 3;
+  rsuint8 count = 0;
+  LogRecordType *record;
+
+  while ((p - buffer) + LOG_RECORD_SIZE <= max_len &&
+         (record = log_read()) != NULL) {
+    p = put_u32(p, record->time);
+    *p++ = record->level;
+    *p++ = record->msg;
+    p = put_u32(p, record->arg[0]);
+    p = put_u32(p, record->arg[1]);
+    count++;
   }
 
-  // Extract extra parameter with encryption subalgorithm, if given
-  ap_ptr = extract_substring(securityType_str, ap_data, ap_ptr);
-  if (ap_ptr != -1) {
-    #ifdef USE_LUART_TERMINAL
-    PRINT("subAlgo="); PRINTLN(securityType_str);
-    #endif
-    
-    // Update cipher subalgorithm
-    if (!strcasecmp((char*)securityType_str, "TKIP")) {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("Set TKIP");
-      #endif
-      ap_info->Mcipher = AWCT_TKIP; 
-      ap_info->Ucipher = AWCT_TKIP;
-    }
-    else if (!strcasecmp((char*)securityType_str, "AES")) {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("Set AES");
-      #endif
-      ap_info->Mcipher = AWCT_CCMP; 
-      ap_info->Ucipher = AWCT_CCMP;
-    }
-    else {
-      #ifdef USE_LUART_TERMINAL
-      PRINT("Unknown encryption ");
-      PRINTLN(securityType_str);
-      #endif
-    }    
+  buffer[0] = count;
+  put_u16(buffer + 1, log_dropped);
+  log_dropped = 0;
+  return (rsuint16)(p - buffer);
+}
+
+#ifdef USE_LUART_TERMINAL
+/**
+ * @brief Prints some of the pending log records. Called when idle, so
+ * that the formatting does not change the timing of the code logging.
+ **/
+static void log_flush_to_uart(void) {
+  LogRecordType *record;
+  int n = 0;
+
+  while (n++ < LOG_FLUSH_BATCH && (record = log_read()) != NULL) {
+    sprintf(TmpStr, "[%lu] ", (unsigned long)record->time);
+    PRINT(TmpStr);
+    sprintf(TmpStr, LogFormats[record->msg],
+            (unsigned long)record->arg[0], (unsigned long)record->arg[1]);
+    PRINTLN(TmpStr);
   }
-  #ifdef USE_LUART_TERMINAL
-  else
-    PRINTLN("No extra subalgo param");
-  #endif
 }
+#endif
 
 /**
- * @brief Setups an AP
- * @param Pt : current protothread pointer
- * @param Mail : protothread mail
- * @param ap_data : input configuration string. If NULL, it will use
- * the data stored at the NVS to configure the AP
+ * @brief Returns the current radio state for the energy estimator
  **/
-static PT_THREAD(PtWifi_setup_AP(struct pt *Pt, const RosMailType *Mail, rsuint8 *ap_data)) {
-  // Examples of AP data strings:
-  // "SSID\nWPA2\npassword\n"
-  // "SSID\nWPA2\password\nAES\n"  
-  
-  static struct pt childPt;
-  
-  PT_BEGIN(Pt);
+static rsuint8 energy_radio_now(void) {
+  int i;
 
-  ApInfoType *ap_info = &app_data.ap_info;
-  // Decode AP configuration, only if a config. string is given.
-  // If not, the default config (read from NVS at the beginning)
-  // will be used.
-  if (ap_data != NULL)
-    get_ap_info_from_str(ap_data, ap_info);
-   
-  // Save AP information to NVS. Connect must be called afterwards
-  rsuint8 ssid_len = (rsuint8)strlen((char*)ap_info->Ssid);
-  
-  ApiWifiCipherInfoType cipher;
-  cipher.Ucipher = ap_info->Ucipher;
-  cipher.Mcipher = ap_info->Mcipher;
-  
-  AppWifiSetApInfo(0, ssid_len, ap_info->Ssid, ap_info->SecurityType,
-                   cipher, 0, ap_info->KeyLength, ap_info->Key);
-  AppWifiWriteApInfoToNvs();
+  if (!wifi_powered)
+    return ENERGY_RADIO_OFF;
+  if (is_suspended)
+    return ENERGY_RADIO_SLEEP;
+  if (tx_in_flight)
+    return ENERGY_RADIO_TX;
+  if (phase_stats[PHASE_SCAN].running)
+    return ENERGY_RADIO_SCAN;
+  for (i = PHASE_ASSOCIATE; i < PHASE_COUNT; i++)
+    if (phase_stats[i].running)
+      return ENERGY_RADIO_CONNECT;
+  return ENERGY_RADIO_IDLE_LOW + (wifi_power_save_profile & 3);
+}
 
-  // Store AP configuration, if a config. string is given
-  if (ap_data == NULL) {
-    #ifdef USE_LUART_TERMINAL
-    sprintf(TmpStr, "NULL ap_data. Using SSID %s in NVS", ap_info->Ssid);
-    PRINTLN(TmpStr);
-    #endif
+/**
+ * @brief Returns the supply current of a state, in uA. The current
+ * above idle of the TX state is scaled linearly with the transmit power.
+ * @param state : energy state
+ **/
+static rsuint32 energy_state_current(rsuint8 state) {
+  if (state == ENERGY_RADIO_TX) {
+    rsuint32 idle = energy_current[ENERGY_RADIO_IDLE_MAX];
+    rsuint32 tx = energy_current[ENERGY_RADIO_TX];
+    if (tx > idle)
+      return idle + (tx - idle) * wifi_tx_power / MAX_TX_POWER;
   }
-  else
-    Wifi_save_appInfo_to_NVS();
+  return energy_current[state];
+}
 
-  // Disconnect, if associated to an old AP
-  if (AppWifiIsAssociated()) {
-    PT_SPAWN(Pt, &childPt, PtAppWifiDisconnect(&childPt, Mail));
-    #ifdef USE_LUART_TERMINAL
-    if (IS_RECEIVED(API_WIFI_DISCONNECT_IND)) {
-      PRINTLN("Disconnected from old AP\n");
-    }
-    #endif
+/**
+ * @brief Charges the time since the last update to the previous radio
+ * and MCU states, and samples the current ones. It must be called after
+ * every change of the variables used by energy_radio_now.
+ **/
+static void energy_update(void) {
+  rsuint32 now = UPTIME_MS();
+  rsuint32 elapsed = now - energy_last_update;
+  rsuint32 current = energy_state_current(energy_radio_state) +
+                     energy_state_current(energy_mcu_state);
+
+  energy_last_update = now;
+  energy_state_time[energy_radio_state] += elapsed;
+  energy_state_time[energy_mcu_state] += elapsed;
+
+  // ms * uA = nC. Split to avoid overflows on long idle periods.
+  energy_charge_mc += (elapsed / 1000) * (current / 1000);
+  energy_charge_uc += (elapsed / 1000) * (current % 1000) +
+                      (elapsed % 1000) * current / 1000;
+  energy_charge_mc += energy_charge_uc / 1000;
+  energy_charge_uc %= 1000;
+
+  energy_radio_state = energy_radio_now();
+  energy_mcu_state = mcu_in_em2 ? ENERGY_MCU_EM2 : ENERGY_MCU_EM1;
+}
+
+/**
+ * @brief Serializes the energy statistics (see command #27)
+ * @param buffer : output buffer, at least 20 + ENERGY_STATE_COUNT*4 bytes
+ * @return number of bytes written
+ **/
+static rsuint16 energy_serialize(rsuint8 *buffer) {
+  rsuint8 *p = buffer;
+  rsuint32 charge_uah, per_upload = 0, average = 0, life = 0;
+  rsuint32 seconds;
+  int i;
+
+  energy_update();
+  charge_uah = energy_charge_mc * 10 / 36;
+  if (energy_uploads)
+    per_upload = charge_uah / energy_uploads * 1000 +
+                 charge_uah % energy_uploads * 1000 / energy_uploads;
+  seconds = UPTIME_MS() / 1000;
+  if (seconds) {
+    average = energy_charge_mc / seconds * 1000 +
+              energy_charge_mc % seconds * 1000 / seconds;
+    if (average)
+      life = (rsuint32)energy_battery * 1000 / average;
   }
 
-  PT_END(Pt);
+  p = put_u32(p, charge_uah);
+  p = put_u32(p, energy_uploads);
+  p = put_u32(p, per_upload);
+  p = put_u32(p, average);
+  p = put_u32(p, life);
+  for (i = 0; i < ENERGY_STATE_COUNT; i++)
+    p = put_u32(p, energy_state_time[i]);
+  return (rsuint16)(p - buffer);
 }
 
 /**
- * @brief Suspends the WiFi chip
- * @param Pt : current protothread pointer
- * @param Mail : protothread mail
+ * @brief Clears the energy statistics
  **/
-static PT_THREAD(PtWifi_suspend(struct pt *Pt, const RosMailType *Mail)) {
-  PT_BEGIN(Pt);
-  is_suspended = true;
-  POWER_TEST_PIN_TOGGLE;
-  SendApiWifiSuspendReq(COLA_TASK, 10*60*1000); // ms
-  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SUSPEND_CFM));
-  POWER_TEST_PIN_TOGGLE;
-  EMU_EnterEM2(); // uC enter suspend, too. Use an external interrupt to wake up!
-  PT_END(Pt);
+static void energy_reset(void) {
+  int i;
+
+  energy_update();
+  for (i = 0; i < ENERGY_STATE_COUNT; i++)
+    energy_state_time[i] = 0;
+  energy_charge_mc = 0;
+  energy_charge_uc = 0;
+  energy_uploads = 0;
 }
 
+/**
+ * @brief Starts timing a connection phase
+ * @param phase : phase to time
+ **/
+static void phase_begin(ConnPhaseType phase) {
+  phase_stats[phase].running = TRUE;
+  phase_stats[phase].start = UPTIME_MS();
+  energy_update();
+}
 
 /**
- * @brief Resumes the suspended WiFi chip
- * @param Pt : current protothread pointer
- * @param Mail : protothread mail
+ * @brief Stops timing a connection phase and updates its statistics.
+ * Nothing is done if the phase is not running.
+ * @param phase : phase to stop
  **/
-static PT_THREAD(PtWifi_resume(struct pt *Pt, const RosMailType *Mail)) {
-  PT_BEGIN(Pt);
-  POWER_TEST_PIN_TOGGLE;
-  SendApiWifiResumeReq(COLA_TASK);
-  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_RESUME_CFM));
-  POWER_TEST_PIN_TOGGLE;
-  is_suspended = false;
-  PT_END(Pt);
+static void phase_end(ConnPhaseType phase) {
+  PhaseStatsType *stats = &phase_stats[phase];
+  if (!stats->running)
+    return;
+  stats->running = FALSE;
+  energy_update();
+
+  rsuint32 elapsed = UPTIME_MS() - stats->start;
+  stats->last = elapsed;
+  if (stats->count == 0 || elapsed < stats->min)
+    stats->min = elapsed;
+  if (elapsed > stats->max)
+    stats->max = elapsed;
+  stats->total += elapsed;
+  if (++stats->count == 0xffff) {
+    // Keep the average meaningful by halving the history
+    stats->count /= 2;
+    stats->total /= 2;
+  }
 }
 
 /**
- * @brief Sets the powersave profile
- * @param profile : powersave profile, 0: low power, 1: medium power,
- * 2: high power, 3: max power
+ * @brief Stops timing a connection phase without updating the
+ * statistics (the phase failed)
+ * @param phase : phase to abort
  **/
-void Wifi_set_power_save_profile(rsuint8 profile) {
-  rsuint8 p;
-  switch (profile) {
-    case 0: p = POWER_SAVE_LOW_IDLE; break; // low power
-    case 1: p = POWER_SAVE_MEDIUM_IDLE; break; // medium power
-    case 2: p = POWER_SAVE_HIGH_IDLE; break; // high power
-    case 3: p = POWER_SAVE_MAX_POWER; break; // max power
-    default: p = 0xff;
+static void phase_abort(ConnPhaseType phase) {
+  phase_stats[phase].running = FALSE;
+  energy_update();
+}
+
+/**
+ * @brief Serializes the profiler statistics.
+ * For each phase: count (rsuint16), last, min, avg and max (rsuint32, ms)
+ * @param buffer : output buffer, at least PHASE_COUNT*18 bytes
+ * @return number of bytes written
+ **/
+static rsuint16 phase_stats_serialize(rsuint8 *buffer) {
+  rsuint8 *p = buffer;
+  int i;
+  for (i = 0; i < PHASE_COUNT; i++) {
+    PhaseStatsType *stats = &phase_stats[i];
+    p = put_u16(p, stats->count);
+    p = put_u32(p, stats->last);
+    p = put_u32(p, stats->min);
+    p = put_u32(p, stats->count ? stats->total / stats->count : 0);
+    p = put_u32(p, stats->max);
   }
-  
-  if (p != 0xff)
-    AppWifiSetPowerSaveProfile(p);
+  return (rsuint16)(p - buffer);
 }
 
 /**
- * @brief Associates and connects to an already configured AP
- * @param Pt : current protothread pointer
- * @param Mail : protothread mail
+ * @brief Clears the profiler statistics, keeping the running phases
  **/
-static PT_THREAD(PtWifi_connect(struct pt *Pt, const RosMailType *Mail)) {
-  static struct pt childPt;
+static void phase_stats_reset(void) {
+  int i;
+  for (i = 0; i < PHASE_COUNT; i++) {
+    phase_stats[i].count = 0;
+    phase_stats[i].last = 0;
+    phase_stats[i].min = 0;
+    phase_stats[i].max = 0;
+    phase_stats[i].total = 0;
+  }
+}
 
-  PT_BEGIN(Pt);
-  
+/**
+ * @brief Allocates a block of POOL_BLOCK_SIZE bytes from the pool
+ * @return block pointer, or NULL if all the blocks are in use
+ **/
+static rsuint8 *pool_alloc(void) {
+  int i;
+  for (i = 0; i < POOL_BLOCK_COUNT; i++) {
+    if (!pool_used[i]) {
+      pool_used[i] = TRUE;
+      if (++pool_in_use > pool_high_water)
+        pool_high_water = pool_in_use;
+      return pool_blocks[i];
+    }
+  }
+  pool_failures++;
+  return NULL;
+}
+
+// Waits for a pool block. Only the first attempt can fail, so a wait
+// counts as a single failed request, however long it takes.
+#define PT_WAIT_BLOCK(pt, block)                                      \
+  do {                                                                \
+    if (((block) = pool_alloc()) == NULL)                             \
+      PT_WAIT_UNTIL(pt, pool_in_use < POOL_BLOCK_COUNT &&             \
+                        ((block) = pool_alloc()) != NULL);            \
+  } while (0)
+
+/**
+ * @brief Gives a block back to the pool
+ * @param block : block returned by pool_alloc. NULL is ignored.
+ **/
+static void pool_free(rsuint8 *block) {
+  if (block == NULL)
+    return;
+  int i = (block - pool_blocks[0]) / POOL_BLOCK_SIZE;
+  if (pool_used[i]) {
+    pool_used[i] = FALSE;
+    pool_in_use--;
+  }
+}
+
+/**
+ * @brief Keeps a buffer received by the socket until it is read
+ * @param handle : socket which received the buffer
+ * @param ptr : buffer allocated by the socket stack
+ * @param length : number of bytes in the buffer
+ * @return False if the queue is full (the buffer is freed, its data is
+ * lost and rx_overflow is set until the next flush)
+ **/
+static rsbool rx_queue_push(int handle, rsuint8 *ptr, rsuint16 length) {
+  if (rx_queue_count == RX_QUEUE_LENGTH) {
+    SendApiSocketFreeBufferReq(COLA_TASK, handle, ptr);
+    rx_overflow = TRUE;
+    return FALSE;
+  }
+
+  RxBufferType *buffer =
+    &rx_queue[(rx_queue_head + rx_queue_count) % RX_QUEUE_LENGTH];
+  buffer->handle = handle;
+  buffer->ptr = ptr;
+  buffer->length = length;
+  rx_queue_count++;
+  rx_pending += length;
+  bytes_received += length;
+  PERF_COUNT(bytes_received, length);
+  TCP_received = true;
+  return TRUE;
+}
+
+/**
+ * @brief Reads received data. The socket buffers are given back to the
+ * stack as soon as they are completely read, which reopens the TCP
+ * receive window.
+ * @param dest : destination buffer
+ * @param max_len : maximum number of bytes to read
+ * @return number of bytes read
+ **/
+static rsuint16 rx_queue_read(rsuint8 *dest, rsuint16 max_len) {
+  rsuint16 read = 0;
+
+  while (read < max_len && rx_queue_count > 0) {
+    RxBufferType *buffer = &rx_queue[rx_queue_head];
+    rsuint16 len = buffer->length - rx_offset;
+    if (len > max_len - read)
+      len = max_len - read;
+
+    memcpy(dest + read, buffer->ptr + rx_offset, len);
+    read += len;
+    rx_offset += len;
+
+    if (rx_offset == buffer->length) {
+      SendApiSocketFreeBufferReq(COLA_TASK, buffer->handle, buffer->ptr);
+      rx_queue_head = (rx_queue_head + 1) % RX_QUEUE_LENGTH;
+      rx_queue_count--;
+      rx_offset = 0;
+    }
+  }
+
+  rx_pending -= read;
+  TCP_received = (rx_queue_count > 0);
+  return read;
+}
+
+/**
+ * @brief Drops all the received data not read yet
+ **/
+static void rx_queue_flush(void) {
+  while (rx_queue_count > 0) {
+    RxBufferType *buffer = &rx_queue[rx_queue_head];
+    SendApiSocketFreeBufferReq(COLA_TASK, buffer->handle, buffer->ptr);
+    rx_queue_head = (rx_queue_head + 1) % RX_QUEUE_LENGTH;
+    rx_queue_count--;
+  }
+  rx_offset = 0;
+  rx_pending = 0;
+  rx_overflow = FALSE;
+  TCP_received = false;
+}
+
+#ifdef FAULT_INJECTION
+/**
+ * @brief Decides whether to inject a fault, with a linear congruential
+ * generator so that a seed gives always the same sequence of faults
+ * @param percent : probability of the fault
+ **/
+static rsbool fault_roll(rsuint8 percent) {
+  fault_random = fault_random * 1103515245UL + 12345;
+  return ((fault_random >> 16) % 100) < percent;
+}
+#endif
+
+static void tx_queue_confirm(RsStatusType status);
+
+/**
+ * @brief Checks if the link is good enough for the deferred sends
+ **/
+static rsbool link_is_good(void) {
+  rsuint8 history = tx_history;
+  rsuint8 successes = 0;
+
+  while (history) {
+    successes += history & 1;
+    history >>= 1;
+  }
+  return wifi_rssi >= defer_rssi && successes >= defer_successes;
+}
+
+/**
+ * @brief Checks if an entry of the TX queue is a deferred send waiting
+ * for a better link
+ * @param entry : TX queue entry
+ **/
+static rsbool tx_entry_held(const TxEntryType *entry) {
+  return entry->deferred && !TIME_REACHED(entry->deadline) &&
+         !link_is_good();
+}
+
+/**
+ * @brief Checks if the head of the TX queue is a deferred send waiting
+ * for a better link. Since tx_queue_pump moves the sends which can go
+ * to the head, the whole queue is then waiting.
+ **/
+static rsbool tx_queue_held(void) {
+  return tx_queue_count > 0 && !tx_in_flight &&
+         tx_entry_held(&tx_queue[tx_queue_head]);
+}
+
+/**
+ * @brief Moves the first send which is not held to the head of the TX
+ * queue, so that the held deferred sends do not block the others
+ * @return FALSE if all the queued sends are held
+ **/
+static rsbool tx_queue_select(void) {
+  rsuint8 i, j;
+  for (i = 0; i < tx_queue_count; i++) {
+    if (!tx_entry_held(&tx_queue[(tx_queue_head + i) % TX_QUEUE_LENGTH]))
+      break;
+  }
+  if (i == tx_queue_count)
+    return FALSE;
+
+  TxEntryType selected = tx_queue[(tx_queue_head + i) % TX_QUEUE_LENGTH];
+  for (j = i; j > 0; j--)
+    tx_queue[(tx_queue_head + j) % TX_QUEUE_LENGTH] =
+      tx_queue[(tx_queue_head + j - 1) % TX_QUEUE_LENGTH];
+  tx_queue[tx_queue_head] = selected;
+  return TRUE;
+}
+
+/**
+ * @brief Gives the first send of the TX queue which is not a held
+ * deferred send to the socket, unless a send is already in progress or
+ * the WiFi is suspended
+ **/
+static void tx_queue_pump(void) {
+  if (tx_in_flight || tx_queue_count == 0 || is_suspended ||
+      !tx_queue_select())
+    return;
+
+  // Queued for a session which is not open any more
+  if (tx_queue[tx_queue_head].socket != socketHandle || socketHandle == 0) {
+    tx_in_flight = TRUE;
+    tx_queue_confirm(RSS_FAILED);
+    return;
+  }
+
+  #ifdef FAULT_INJECTION
+  if (fault_roll(fault_config.send_drop)) {
+    fault_count[1]++;
+    tx_in_flight = TRUE;
+    tx_queue_confirm(RSS_FAILED);
+    return;
+  }
+  #endif
+
+  // The server cannot decode a delta against a frame it did not get
+  TxEntryType *entry = &tx_queue[tx_queue_head];
+  if (entry->encoding & ENCODE_FRAME) {
+    if ((entry->encoding & ENCODE_DELTA) && encode_base_lost) {
+      tx_in_flight = TRUE;
+      tx_queue_confirm(RSS_FAILED);
+      return;
+    }
+    encode_base_lost = FALSE;
+  }
+
+  if (entry->deferred)
+    defer_stats[link_is_good() ? 1 : 2]++;
+  SendApiSocketSendReq(COLA_TASK, socketHandle, entry->data,
+                       entry->length, 0);
+  tx_in_flight = TRUE;
+  energy_update();
+}
+
+/**
+ * @brief Returns the entry to fill for the next send, with a pool block
+ * for its data. It must be given to tx_queue_commit or tx_queue_cancel.
+ * @return TX queue entry, or NULL if the queue or the pool is full
+ **/
+static TxEntryType *tx_queue_alloc(void) {
+  if (tx_queue_count == TX_QUEUE_LENGTH)
+    return NULL;
+
+  TxEntryType *entry =
+    &tx_queue[(tx_queue_head + tx_queue_count) % TX_QUEUE_LENGTH];
+  entry->deferred = FALSE;
+  entry->encoding = 0;
+  entry->data = pool_alloc();
+  return entry->data != NULL ? entry : NULL;
+}
+
+/**
+ * @brief Returns the number of sends which can be queued now
+ **/
+static rsuint8 tx_queue_free(void) {
+  rsuint8 free_entries = TX_QUEUE_LENGTH - tx_queue_count;
+  rsuint8 free_blocks = POOL_BLOCK_COUNT - pool_in_use;
+  return free_entries < free_blocks ? free_entries : free_blocks;
+}
+
+/**
+ * @brief Releases an entry returned by tx_queue_alloc without sending it
+ * @param entry : TX queue entry
+ **/
+static void tx_queue_cancel(TxEntryType *entry) {
+  pool_free(entry->data);
+  entry->data = NULL;
+}
+
+/**
+ * @brief Queues the entry returned by tx_queue_alloc
+ * @param entry : entry whose data has been filled
+ * @param length : number of bytes to send
+ * @return sequence number of the send
+ **/
+static rsuint8 tx_queue_commit(TxEntryType *entry, rsuint16 length) {
+  entry->length = length;
+  entry->socket = socketHandle;
+  entry->id = ++tx_last_id;
+  entry->seq = tx_next_seq++;
+  if (tx_next_seq == 0)
+    tx_next_seq = 1;
+  tx_queue_count++;
+  LOG_DEBUG(LOG_SEND_QUEUED, entry->seq, length);
+  tx_queue_pump();
+  return entry->seq;
+}
+
+/**
+ * @brief Completes the send in progress and starts the next one
+ * @param status : status given by API_SOCKET_SEND_CFM
+ **/
+static void tx_queue_confirm(RsStatusType status) {
+  if (!tx_in_flight)
+    return;
+
+  TxEntryType *entry = &tx_queue[tx_queue_head];
+  LOG_DEBUG(LOG_SEND_DONE, entry->seq, status);
+  tx_done_seq = entry->seq;
+  last_send_status = (rsuint8)status;
+  tx_history = (tx_history << 1) | (status == RSS_SUCCESS);
+  if (status == RSS_SUCCESS) {
+    bytes_sent += entry->length;
+    PERF_COUNT(bytes_sent, entry->length);
+    energy_uploads++;
+  }
+  else {
+    tx_failed_seq = entry->seq;
+    tx_failed_id = entry->id;
+    tx_failures++;
+    PERF_COUNT(send_failures, 1);
+    if (entry->encoding & ENCODE_FRAME) {
+      // The next frames must not be deltas against this one
+      encode_prev_length = 0;
+      encode_base_lost = TRUE;
+    }
+  }
+
+  pool_free(entry->data);
+  entry->data = NULL;
+  tx_queue_head = (tx_queue_head + 1) % TX_QUEUE_LENGTH;
+  tx_queue_count--;
+  tx_in_flight = FALSE;
+  energy_update();
+  tx_queue_pump();
+}
+
+/**
+ * @brief Fails all the queued sends, including the one in progress,
+ * when the TCP session they were queued for is closed
+ **/
+static void tx_queue_flush(void) {
+  while (tx_queue_count > 0) {
+    TxEntryType *entry = &tx_queue[tx_queue_head];
+    LOG_DEBUG(LOG_SEND_DONE, entry->seq, RSS_FAILED);
+    tx_done_seq = tx_failed_seq = entry->seq;
+    tx_failed_id = entry->id;
+    last_send_status = (rsuint8)RSS_FAILED;
+    tx_failures++;
+    PERF_COUNT(send_failures, 1);
+    pool_free(entry->data);
+    entry->data = NULL;
+    tx_queue_head = (tx_queue_head + 1) % TX_QUEUE_LENGTH;
+    tx_queue_count--;
+  }
+  if (tx_in_flight) {
+    tx_in_flight = FALSE; // Its confirmation is ignored
+    energy_update();
+  }
+}
+
+/**
+ * @brief Returns a byte of the LZSS window, which is the static
+ * dictionary followed by the frame being compressed
+ * @param in : frame being compressed
+ * @param pos : position in the window
+ **/
+static rsuint8 lz_window_byte(const rsuint8 *in, rsuint16 pos) {
+  return pos < LZ_DICTIONARY_LENGTH ? LzDictionary[pos]
+                                    : in[pos - LZ_DICTIONARY_LENGTH];
+}
+
+/**
+ * @brief Adds a position of the LZSS window to the hash chain of the 3
+ * bytes which start there
+ * @param in : frame being compressed
+ * @param pos : position in the window
+ **/
+static void lz_insert(const rsuint8 *in, rsuint16 pos) {
+  rsuint8 hash = (rsuint8)((lz_window_byte(in, pos) * 33 +
+                            lz_window_byte(in, pos + 1)) * 33 +
+                           lz_window_byte(in, pos + 2));
+  lz_prev[pos] = lz_head[hash];
+  lz_head[hash] = pos;
+}
+
+/**
+ * @brief Compresses a frame with LZSS. Each flag byte announces 8
+ * tokens, from its bit 0: 1 for a match, 0 for a literal byte. A match
+ * takes 2 bytes: the low 8 bits of the distance back in the window, and
+ * then the high 4 bits of the distance and the length minus LZ_MIN_MATCH.
+ * Matches are looked for among the last LZ_MAX_CHAIN occurrences of the
+ * next 3 bytes.
+ * @param in : frame to compress
+ * @param len : frame length
+ * @param out : output buffer
+ * @param max_len : size of the output buffer
+ * @return compressed length, or 0 if it does not fit
+ **/
+static rsuint16 lz_compress(const rsuint8 *in, rsuint16 len,
+                            rsuint8 *out, rsuint16 max_len) {
+  rsuint16 in_pos = 0, out_pos = 0, flag_pos = 0;
+  rsuint16 end = LZ_DICTIONARY_LENGTH + len;
+  rsuint16 pos;
+  rsuint8 token = 8;
+
+  memset(lz_head, 0xff, sizeof(lz_head));
+  for (pos = 0; pos < LZ_DICTIONARY_LENGTH && pos + LZ_MIN_MATCH <= end; pos++)
+    lz_insert(in, pos);
+
+  while (in_pos < len) {
+    rsuint16 best_len = 0, best_dist = 0, candidate, step;
+    int chain = LZ_MAX_CHAIN;
+    pos = LZ_DICTIONARY_LENGTH + in_pos;
+
+    // Find the longest match. It may overlap the current position.
+    if (pos + LZ_MIN_MATCH <= end) {
+      lz_insert(in, pos);
+      candidate = lz_prev[pos];
+      while (candidate != LZ_NONE && chain-- > 0 &&
+             pos - candidate <= LZ_MAX_DISTANCE) {
+        rsuint16 n = 0;
+        while (n < LZ_MAX_MATCH && in_pos + n < len &&
+               lz_window_byte(in, candidate + n) == in[in_pos + n])
+          n++;
+        if (n > best_len) {
+          best_len = n;
+          best_dist = pos - candidate;
+          if (n == LZ_MAX_MATCH)
+            break;
+        }
+        candidate = lz_prev[candidate];
+      }
+    }
+
+    if (token == 8) {
+      if (out_pos >= max_len)
+        return 0;
+      flag_pos = out_pos++;
+      out[flag_pos] = 0;
+      token = 0;
+    }
+
+    if (best_len >= LZ_MIN_MATCH) {
+      if (out_pos + 2 > max_len)
+        return 0;
+      out[flag_pos] |= 1 << token;
+      out[out_pos++] = best_dist & 0xff;
+      out[out_pos++] = ((best_dist >> 8) << 4) | (best_len - LZ_MIN_MATCH);
+      step = best_len;
+    }
+    else {
+      if (out_pos + 1 > max_len)
+        return 0;
+      out[out_pos++] = in[in_pos];
+      step = 1;
+    }
+    token++;
+
+    // The positions covered by a match can start later matches too
+    for (in_pos++, pos++; --step > 0; in_pos++, pos++) {
+      if (pos + LZ_MIN_MATCH <= end)
+        lz_insert(in, pos);
+    }
+  }
+  return out_pos;
+}
+
+/**
+ * @brief Encodes a frame in place, as configured with command #34. The
+ * encoded frame is [flags][original length][encoded length][data], with
+ * the lengths as rsuint16. The flags tell which of ENCODE_DELTA and
+ * ENCODE_LZ were applied: the delta needs a previous frame of the same
+ * length, and the compression is dropped if it does not save space. The
+ * header is always written, also when no encoding could be applied.
+ * @param entry : TX queue entry with the frame, in a buffer of
+ * POOL_BLOCK_SIZE bytes
+ * @param len : frame length, up to TX_BUFFER_LENGTH
+ * @return encoded length
+ **/
+static rsuint16 encode_frame(TxEntryType *entry, rsuint16 len) {
+  rsuint8 *data = entry->data;
+  rsuint8 *scratch = encode_scratch;
+  rsuint8 flags = 0;
+  rsuint16 out_len = 0;
+  rsuint32 start = DWT->CYCCNT;
+  int i;
+
+  if (encode_mode == 0)
+    return len;
+
+  // Delta against the previous frame, which is then replaced
+  if ((encode_mode & ENCODE_DELTA) && encode_prev_length == len) {
+    for (i = 0; i < len; i++)
+      scratch[i] = data[i] - encode_prev[i];
+    flags |= ENCODE_DELTA;
+  }
+  else
+    memcpy(scratch, data, len);
+  memcpy(encode_prev, data, len);
+  encode_prev_length = len;
+
+  if ((encode_mode & ENCODE_LZ) && len > LZ_MIN_MATCH)
+    out_len = lz_compress(scratch, len, data + ENCODE_HEADER_LENGTH, len - 1);
+  if (out_len != 0)
+    flags |= ENCODE_LZ;
+  else {
+    memcpy(data + ENCODE_HEADER_LENGTH, scratch, len);
+    out_len = len;
+  }
+
+  data[0] = flags;
+  entry->encoding = ENCODE_FRAME | flags;
+  put_u16(data + 1, len);
+  put_u16(data + 3, out_len);
+  out_len += ENCODE_HEADER_LENGTH;
+
+  encode_frames++;
+  encode_bytes_in += len;
+  encode_bytes_out += out_len;
+  encode_cycles += DWT->CYCCNT - start;
+  return out_len;
+}
+
+/**
+ * @brief Saves the application info object contents to NVS
+ **/
+void Wifi_save_appInfo_to_NVS() {
+  NvsWrite(NVS_OFFSET(Free),
+           sizeof(AppDataType),
+           (rsuint8*)&app_data);
+}
+
+/**
+ * @brief Retrieves the application info object contents to NVS. The
+ * fields unknown to the firmware which wrote them are reset to 0.
+ * @return TRUE if the NVS was written with another layout
+ **/
+rsbool Wifi_read_appInfo_from_NVS() {
+  rsuint16 known = offsetof(AppDataType, layout_magic);
+  rsbool other_layout = TRUE;
+
+  NvsRead(NVS_OFFSET(Free),
+          sizeof(AppDataType),
+          (rsuint8 *)&app_data);
+
+  if (app_data.layout_magic == NVS_LAYOUT_MAGIC &&
+      app_data.layout_version == NVS_LAYOUT_VERSION &&
+      app_data.layout_size > offsetof(AppDataType, layout_size)) {
+    known = app_data.layout_size;
+    other_layout = FALSE;
+  }
+  if (known < sizeof(AppDataType))
+    memset((rsuint8*)&app_data + known, 0, sizeof(AppDataType) - known);
+  // Older firmware stored the passphrase, or a PMK given by the host
+  if (known <= offsetof(AppDataType, key_is_pmk))
+    app_data.key_is_pmk = (app_data.ap_info.KeyLength == 2 * PMK_LENGTH);
+  app_data.layout_magic = NVS_LAYOUT_MAGIC;
+  app_data.layout_version = NVS_LAYOUT_VERSION;
+  app_data.layout_size = sizeof(AppDataType);
+  return other_layout;
+}
+
+/**
+ * @brief Reads the performance counters from NVS, and counts the boot
+ **/
+static void perf_load(void) {
+  NvsRead(PERF_NVS_OFFSET, sizeof(perf), (rsuint8*)&perf);
+  if (perf.valid != PERF_MAGIC) {
+    memset(&perf, 0, sizeof(perf));
+    perf.valid = PERF_MAGIC;
+  }
+  PERF_COUNT(boots, 1);
+}
+
+/**
+ * @brief Reads the application data from NVS. After an upgrade from
+ * another NVS layout, it drops the HTTP cache and the performance
+ * counters, which are not where that layout had them, and writes the
+ * data back with the current layout.
+ **/
+static void nvs_load(void) {
+  HttpCacheHeaderType empty_cache;
+
+  if (Wifi_read_appInfo_from_NVS()) {
+    memset(&empty_cache, 0, sizeof(empty_cache));
+    NvsWrite(HTTP_CACHE_NVS_OFFSET, sizeof(empty_cache),
+             (rsuint8*)&empty_cache);
+    memset(&perf, 0, sizeof(perf));
+    NvsWrite(PERF_NVS_OFFSET, sizeof(perf), (rsuint8*)&perf);
+    Wifi_save_appInfo_to_NVS();
+  }
+  perf_load();
+}
+
+/**
+ * @brief Adds the whole seconds elapsed since the last call to the
+ * cumulative uptime
+ **/
+static void perf_update_uptime(void) {
+  rsuint32 seconds = (UPTIME_MS() - perf_uptime_mark) / 1000;
+  perf_uptime_mark += seconds * 1000;
+  perf.uptime += seconds;
+}
+
+/**
+ * @brief Writes the performance counters to NVS, if they changed
+ **/
+static void perf_flush(void) {
+  perf_update_uptime();
+  perf_flush_time = UPTIME_MS();
+  if (!perf_dirty)
+    return;
+  NvsWrite(PERF_NVS_OFFSET, sizeof(perf), (rsuint8*)&perf);
+  perf_dirty = FALSE;
+}
+
+/**
+ * @brief Builds the performance counters block (see command #41)
+ * @param buffer : output buffer, at least 32 bytes
+ * @return number of bytes written
+ **/
+static rsuint16 perf_serialize(rsuint8 *buffer) {
+  rsuint8 *p = buffer;
+  perf_update_uptime();
+  p = put_u16(p, perf.boots);
+  p = put_u16(p, perf.wifi_connects);
+  p = put_u16(p, perf.wifi_failures);
+  p = put_u16(p, perf.tcp_connects);
+  p = put_u16(p, perf.link_losses);
+  p = put_u16(p, perf.dns_failures);
+  p = put_u16(p, perf.send_failures);
+  p = put_u32(p, perf.bytes_sent);
+  p = put_u32(p, perf.bytes_received);
+  p = put_u32(p, perf.suspended_time);
+  p = put_u32(p, perf.uptime);
+  return (rsuint16)(p - buffer);
+}
+
+/**
+ * @brief Gives the current Unix time, kept from the last SNTP sync
+ * @param o_ms : milliseconds within the second, or NULL
+ * @return Unix time in seconds, 0 if it was never synced
+ **/
+static rsuint32 time_now(rsuint16 *o_ms) {
+  rsuint32 elapsed = UPTIME_MS() - time_base_uptime + time_base_ms;
+  if (o_ms != NULL)
+    *o_ms = time_synced ? elapsed % 1000 : 0;
+  return time_synced ? time_base + elapsed / 1000 : 0;
+}
+
+/**
+ * @brief Replaces the first TIME_MARKER in queued data with the current
+ * Unix time, in decimal and with the same length
+ * @param data : data to send
+ * @param len : number of bytes
+ **/
+static void time_stamp(rsuint8 *data, rsuint16 len) {
+  rsuint32 now = time_now(NULL);
+  int i, j;
+
+  for (i = 0; i + TIME_MARKER_LENGTH <= len; i++) {
+    if (memcmp(data + i, TIME_MARKER, TIME_MARKER_LENGTH) == 0) {
+      for (j = TIME_MARKER_LENGTH - 1; j >= 0; j--) {
+        data[i + j] = '0' + now % 10;
+        now /= 10;
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Checks if the cached DHCP lease can be applied directly
+ * @return True if the lease is valid, allowed by the policy and not
+ * expired. A lease of a previous boot needs the time (see command #42)
+ * to know its age.
+ **/
+static rsbool dhcp_lease_usable(void) {
+  DhcpLeaseType *lease = &app_data.lease;
+
+  if (lease->valid != LEASE_VALID_MAGIC)
+    return FALSE;
+
+  if (!lease_warm) {
+    switch (app_data.lease_policy) {
+      case LEASE_CACHE_SAME_BOOT:
+        if (lease_obtained_ms == 0)
+          return FALSE; // Not obtained since the last reboot
+        break;
+      case LEASE_CACHE_ALWAYS:
+        if (lease_obtained_ms == 0)
+          return time_synced && lease->obtained != 0 &&
+                 time_now(NULL) - lease->obtained < lease->lifetime;
+        break;
+      default:
+        return FALSE;
+    }
+  }
+
+  return (UPTIME_MS() - lease_obtained_ms) / 1000 < lease->lifetime;
+}
+
+/**
+ * @brief Stores the lease just obtained by DHCP in the cache, and in the
+ * NVS if it changed. A renewal of the same lease keeps the older time
+ * at the NVS, so its age is overestimated after a reboot.
+ **/
+static void dhcp_lease_store(void) {
+  DhcpLeaseType *lease = &app_data.lease;
+  DhcpLeaseType previous = *lease;
+  rsbool time_learnt;
+
+  lease->address = AppWifiIpv4GetAddress();
+  lease->subnet = AppWifiIpv4GetSubnetMask();
+  lease->gateway = AppWifiIpv4GetGateway();
+  lease->dns = AppWifiIpv4GetPrimaryDns();
+  lease->lifetime = app_data.lease_lifetime ? app_data.lease_lifetime
+                                            : LEASE_DEFAULT_LIFETIME;
+  lease->valid = LEASE_VALID_MAGIC;
+  lease->obtained = dhcp_acquired_time;
+  lease_obtained_ms = dhcp_acquired_ms;
+
+  time_learnt = previous.obtained == 0 && lease->obtained != 0;
+  previous.obtained = lease->obtained;
+  if (memcmp(&previous, lease, sizeof(previous)) != 0 || time_learnt)
+    Wifi_save_appInfo_to_NVS();
+}
+
+/**
+ * @brief Drops the cached DHCP lease. If it was in use, a full DHCP
+ * exchange is started instead.
+ **/
+static void dhcp_lease_invalidate(void) {
+  if (app_data.lease.valid == LEASE_VALID_MAGIC) {
+    LOG_WARNING(LOG_LEASE_DROPPED, 0, 0);
+    app_data.lease.valid = 0;
+    Wifi_save_appInfo_to_NVS();
+  }
+
+  if (lease_in_use) {
+    lease_in_use = FALSE;
+    AppWifiIpv4Config(FALSE, 0, 0, 0, 0);
+  }
+}
+
+/**
+ * @brief Checks if resolvers are configured for the UDP queries
+ **/
+static rsbool dns_servers_configured(void) {
+  return app_data.dns_config == DNS_CONFIG_MAGIC &&
+         (app_data.dns_servers[0] != 0 || app_data.dns_servers[1] != 0);
+}
+
+/**
+ * @brief Looks for a name in the DNS cache
+ * @param name : domain name
+ * @return resolved IP address, or 0 if not cached or too old
+ **/
+static rsuint32 dns_cache_lookup(const rsuint8 *name) {
+  int i;
+  for (i = 0; i < DNS_CACHE_LENGTH; i++) {
+    DnsCacheEntryType *entry = &dns_cache[i];
+    rsuint32 lifetime = entry->lifetime;
+    if (lifetime == 0 && entry->pinned)
+      lifetime = DNS_CACHE_TTL_MS;
+    if (entry->ip != 0 && UPTIME_MS() - entry->time < lifetime &&
+        !strcmp((char*)entry->name, (char*)name))
+      return entry->ip;
+  }
+  return 0;
+}
+
+/**
+ * @brief Stores a resolved name in the DNS cache, replacing the entry
+ * with the same name or the oldest one
+ * @param name : domain name
+ * @param ip : resolved IP address
+ * @param ttl : TTL of the record in seconds, 0 if unknown
+ **/
+static void dns_cache_store(const rsuint8 *name, rsuint32 ip, rsuint32 ttl) {
+  DnsCacheEntryType *victim = &dns_cache[0];
+  int i;
+
+  if (strlen((char*)name) >= DNS_NAME_LENGTH)
+    return;
+
+  for (i = 0; i < DNS_CACHE_LENGTH; i++) {
+    DnsCacheEntryType *entry = &dns_cache[i];
+    if (!strcmp((char*)entry->name, (char*)name)) {
+      victim = entry;
+      break;
+    }
+    if (entry->time < victim->time)
+      victim = entry;
+  }
+
+  strcpy((char*)victim->name, (char*)name);
+  victim->ip = ip;
+  victim->time = UPTIME_MS();
+  victim->lifetime = ttl < DNS_CACHE_TTL_MS / 1000 ? ttl * 1000
+                                                   : DNS_CACHE_TTL_MS;
+  victim->pinned = FALSE;
+}
+
+/**
+ * @brief Lets the DNS cache reuse a name even if its TTL is unknown
+ * @param name : domain name, or NULL for all the names
+ **/
+static void dns_cache_pin(const rsuint8 *name) {
+  int i;
+  for (i = 0; i < DNS_CACHE_LENGTH; i++)
+    if (name == NULL || !strcmp((char*)dns_cache[i].name, (char*)name))
+      dns_cache[i].pinned = TRUE;
+}
+
+/**
+ * @brief Checks if a line of HTTP headers is the given header, ignoring
+ * the case of the name
+ * @param line : header line, zero-terminated
+ * @param name : header name, lowercase
+ * @return the header value, or NULL if it is another header
+ **/
+static char *http_header_value(char *line, const char *name) {
+  while (*name) {
+    if (tolower((unsigned char)*line++) != *name++)
+      return NULL;
+  }
+  if (*line++ != ':')
+    return NULL;
+  while (*line == ' ')
+    line++;
+  return line;
+}
+
+/**
+ * @brief Handles a complete line of the HTTP status or headers
+ * @param parser : HTTP parser
+ **/
+static void http_parse_line(HttpParserType *parser) {
+  char *line = (char*)parser->line;
+  char *value;
+
+  if (parser->state == HTTP_PARSE_STATUS) {
+    if (strncmp(line, "HTTP/", 5) == 0 && strlen(line) > 9)
+      parser->status = (rsuint16)atoi(line + 9);
+    parser->state = HTTP_PARSE_HEADERS;
+  }
+  else if (parser->line_length == 0) {
+    // End of the headers. 304 responses have no body, and the chunked
+    // bodies are not decoded.
+    if (parser->status == 304 || parser->chunked ||
+        (parser->has_length && parser->content_length == 0))
+      parser->state = HTTP_PARSE_DONE;
+    else
+      parser->state = HTTP_PARSE_BODY;
+  }
+  else if ((value = http_header_value(line, "content-length")) != NULL) {
+    parser->has_length = TRUE;
+    parser->content_length = strtoul(value, NULL, 10);
+  }
+  else if ((value = http_header_value(line, "transfer-encoding")) != NULL) {
+    parser->chunked = strcasecmp(value, "identity") != 0;
+  }
+  else if (strlen(line) < HTTP_LINE_LENGTH - 1 &&
+           ((value = http_header_value(line, "etag")) != NULL ||
+            ((value = http_header_value(line, "last-modified")) != NULL &&
+             parser->validator_type != HTTP_VALIDATOR_ETAG))) {
+    // Prefer the ETag, and drop the truncated lines and long validators
+    if (strlen(value) < HTTP_VALIDATOR_LENGTH) {
+      strcpy((char*)parser->validator, value);
+      parser->validator_type = (line[0] == 'E' || line[0] == 'e') ?
+                               HTTP_VALIDATOR_ETAG : HTTP_VALIDATOR_DATE;
+    }
+  }
+}
+
+/**
+ * @brief Starts parsing a new HTTP response
+ * @param parser : HTTP parser
+ **/
+static void http_parse_init(HttpParserType *parser) {
+  memset(parser, 0, sizeof(*parser));
+  parser->state = HTTP_PARSE_STATUS;
+  parser->hash = FNV_OFFSET_BASIS;
+}
+
+/**
+ * @brief Parses received bytes of an HTTP response. The body is hashed
+ * and copied to the body buffer as long as it fits.
+ * @param parser : HTTP parser
+ * @param data : received bytes
+ * @param len : number of bytes
+ * @param body : body buffer, HTTP_CACHE_BODY_LENGTH bytes
+ **/
+static void http_parse(HttpParserType *parser, const rsuint8 *data,
+                       rsuint16 len, rsuint8 *body) {
+  while (len-- > 0 && parser->state != HTTP_PARSE_DONE) {
+    rsuint8 c = *data++;
+
+    if (parser->state == HTTP_PARSE_BODY) {
+      if (parser->body_length < HTTP_CACHE_BODY_LENGTH)
+        body[parser->body_length] = c;
+      parser->body_length++;
+      parser->hash = (parser->hash ^ c) * FNV_PRIME;
+      if (parser->has_length &&
+          parser->body_length == parser->content_length)
+        parser->state = HTTP_PARSE_DONE;
+    }
+    else if (c == '\n') {
+      parser->line[parser->line_length] = 0;
+      http_parse_line(parser);
+      parser->line_length = 0;
+    }
+    else if (c != '\r' && parser->line_length < HTTP_LINE_LENGTH - 1) {
+      parser->line[parser->line_length++] = c;
+    }
+  }
+}
+
+/**
+ * @brief Reads the header of the HTTP cache from the NVS
+ **/
+static void http_cache_load(void) {
+  NvsRead(HTTP_CACHE_NVS_OFFSET, sizeof(http_cache), (rsuint8*)&http_cache);
+  http_cache.validator[HTTP_VALIDATOR_LENGTH - 1] = 0;
+  if (http_cache.valid != HTTP_CACHE_MAGIC ||
+      http_cache.length > HTTP_CACHE_BODY_LENGTH)
+    http_cache.valid = 0;
+}
+
+/**
+ * @brief Arms the packet delay timer for the given uptime, unless it is
+ * already armed for an earlier one
+ * @param due : uptime, in ms
+ **/
+static void timer_request(rsuint32 due) {
+  rsint32 delay = (rsint32)(due - UPTIME_MS());
+
+  if (timer_armed && (rsint32)(due - timer_due) >= 0)
+    return;
+  if (delay < 1)
+    delay = 1;
+  RosTimerStart(APP_PACKET_DELAY_TIMER, delay * RS_T1MS, &PacketDelayTimer);
+  timer_armed = TRUE;
+  timer_due = due;
+}
+
+/**
+ * @brief Stops the housekeeping tick and the timer, so that they do not
+ * wake up the microcontroller while suspended. They are scheduled again
+ * after the resume.
+ **/
+static void housekeeping_stop(void) {
+  RosTimerStop(APP_PACKET_DELAY_TIMER);
+  timer_armed = FALSE;
+  housekeeping_running = FALSE;
+}
+
+/**
+ * @brief Returns the FNV-1a hash of the security settings and the key
+ * of the configured AP, so that a scan is not reused for another profile
+ * with the same SSID
+ **/
+static rsuint32 ap_profile_hash(void) {
+  const ApInfoType *ap = &app_data.ap_info;
+  rsuint32 hash = FNV_OFFSET_BASIS;
+  int i;
+
+  hash = (hash ^ (rsuint8)ap->SecurityType) * FNV_PRIME;
+  hash = (hash ^ (rsuint8)ap->Ucipher) * FNV_PRIME;
+  for (i = 0; i < ap->KeyLength && i < sizeof(ap->Key); i++)
+    hash = (hash ^ ap->Key[i]) * FNV_PRIME;
+  return hash;
+}
+
+/**
+ * @brief Checks if the scan cache holds a recent scan for the
+ * configured AP
+ * @param max_age : maximum age of the scan, in seconds
+ **/
+static rsbool scan_cache_is_fresh(rsuint16 max_age) {
+  return scan_cache.valid &&
+         !strcmp((char*)scan_cache.ssid, (char*)app_data.ap_info.Ssid) &&
+         scan_cache.profile == ap_profile_hash() &&
+         (UPTIME_MS() - scan_cache.time) / 1000 < max_age;
+}
+
+/**
+ * @brief Stores the result of the scan just finished
+ **/
+static void scan_cache_store(void) {
+  scan_cache.ap_available = AppWifiIsApAvailable();
+  strncpy((char*)scan_cache.ssid, (char*)app_data.ap_info.Ssid,
+          sizeof(scan_cache.ssid) - 1);
+  scan_cache.ssid[sizeof(scan_cache.ssid) - 1] = 0;
+  scan_cache.profile = ap_profile_hash();
+  scan_cache.time = UPTIME_MS();
+  scan_cache.valid = TRUE;
+}
+
+/**
+ * @brief Fulfills an ApInfoType object from a string
+ * @param ap_data : input string
+ * @param ap_info : AP info object to fulfill
+ * @return False if there was no free pool block to parse it (ap_info
+ * is left unchanged)
+ **/
+rsbool get_ap_info_from_str(rsuint8 *ap_data, ApInfoType *ap_info) {
+  int ap_ptr = 0;
+
+  rsuint8 *securityType_str = pool_alloc();
+  if (securityType_str == NULL)
+    return FALSE;
+  
+  ap_info->KeyIndex = 0;
+
+  // Extract SSID
+  ap_ptr = extract_substring(ap_info->Ssid, ap_data, ap_ptr);
+  ap_info->SsidLength = (rsuint8)strlen((char*)ap_info->Ssid);
+
+  // Extract encryption algorithm
+  ap_ptr = extract_substring(securityType_str, ap_data, ap_ptr);
+
+  // Extract key
+  ap_ptr = extract_substring(ap_info->Key, ap_data, ap_ptr);
+  ap_info->KeyLength = (rsuint8)strlen((char*)ap_info->Key);
+
+  // Set securityType and cipher according to securityType_str
+  ap_info->SecurityType = AWST_NONE; // Just to prevent the warning
+  if (!strcasecmp((char*)securityType_str, "WPA")) {
+    ap_info->SecurityType = AWST_WPA;
+    ap_info->Mcipher = AWCT_TKIP; 
+    ap_info->Ucipher = AWCT_TKIP;
+  }
+  else if (!strcasecmp((char*)securityType_str, "WPA2")) {
+    ap_info->SecurityType = AWST_WPA2;
+    ap_info->Mcipher = AWCT_CCMP; 
+    ap_info->Ucipher = AWCT_CCMP;
+  }
+  else if (!strcasecmp((char*)securityType_str, "NONE")) {
+    ap_info->SecurityType = AWST_NONE;
+  }
+
+  // Extract extra parameter with encryption subalgorithm, if given
+  ap_ptr = extract_substring(securityType_str, ap_data, ap_ptr);
+  if (ap_ptr != -1) {
+    // Update cipher subalgorithm
+    if (!strcasecmp((char*)securityType_str, "TKIP")) {
+      ap_info->Mcipher = AWCT_TKIP; 
+      ap_info->Ucipher = AWCT_TKIP;
+    }
+    else if (!strcasecmp((char*)securityType_str, "AES")) {
+      ap_info->Mcipher = AWCT_CCMP; 
+      ap_info->Ucipher = AWCT_CCMP;
+    }
+    else
+      LOG_WARNING(LOG_AP_UNKNOWN_CIPHER, 0, 0);
+  }
+  LOG_DEBUG(LOG_AP_CONFIG, ap_info->SecurityType, ap_info->Ucipher);
+
+  pool_free(securityType_str);
+  return TRUE;
+}
+
+/**
+ * @brief Hashes the block of a SHA-1 state
+ * @param sha : SHA-1 state
+ **/
+static void sha1_transform(Sha1Type *sha) {
+  rsuint32 w[16];
+  rsuint32 a, b, c, d, e, f, k, tmp;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((rsuint32)sha->block[4*i] << 24) |
+           ((rsuint32)sha->block[4*i + 1] << 16) |
+           ((rsuint32)sha->block[4*i + 2] << 8) | sha->block[4*i + 3];
+
+  a = sha->h[0]; b = sha->h[1]; c = sha->h[2]; d = sha->h[3]; e = sha->h[4];
+  for (i = 0; i < 80; i++) {
+    if (i >= 16) {
+      // The message schedule, in a ring of 16 words
+      tmp = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+      w[i & 15] = (tmp << 1) | (tmp >> 31);
+    }
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    tmp = ((a << 5) | (a >> 27)) + f + e + k + w[i & 15];
+    e = d;
+    d = c;
+    c = (b << 30) | (b >> 2);
+    b = a;
+    a = tmp;
+  }
+  sha->h[0] += a; sha->h[1] += b; sha->h[2] += c; sha->h[3] += d;
+  sha->h[4] += e;
+}
+
+/**
+ * @brief Starts a SHA-1 hash
+ * @param sha : SHA-1 state
+ **/
+static void sha1_init(Sha1Type *sha) {
+  sha->h[0] = 0x67452301;
+  sha->h[1] = 0xEFCDAB89;
+  sha->h[2] = 0x98BADCFE;
+  sha->h[3] = 0x10325476;
+  sha->h[4] = 0xC3D2E1F0;
+  sha->length = 0;
+}
+
+/**
+ * @brief Adds data to a SHA-1 hash
+ * @param sha : SHA-1 state
+ * @param data : data to hash
+ * @param len : number of bytes
+ **/
+static void sha1_update(Sha1Type *sha, const rsuint8 *data, rsuint16 len) {
+  while (len--) {
+    sha->block[sha->length++ % SHA1_BLOCK_LENGTH] = *data++;
+    if (sha->length % SHA1_BLOCK_LENGTH == 0)
+      sha1_transform(sha);
+  }
+}
+
+/**
+ * @brief Ends a SHA-1 hash
+ * @param sha : SHA-1 state
+ * @param digest : output, SHA1_LENGTH bytes
+ **/
+static void sha1_final(Sha1Type *sha, rsuint8 *digest) {
+  rsuint32 bits = sha->length * 8;
+  rsuint8 pad = 0x80;
+  int i;
+
+  sha1_update(sha, &pad, 1);
+  pad = 0;
+  while (sha->length % SHA1_BLOCK_LENGTH != SHA1_BLOCK_LENGTH - 8)
+    sha1_update(sha, &pad, 1);
+  for (i = 0; i < 4; i++)
+    sha1_update(sha, &pad, 1); // Length above 32 bits
+  for (i = 3; i >= 0; i--) {
+    rsuint8 byte = bits >> (8 * i);
+    sha1_update(sha, &byte, 1);
+  }
+  for (i = 0; i < 5; i++) {
+    digest[4*i] = sha->h[i] >> 24;
+    digest[4*i + 1] = sha->h[i] >> 16;
+    digest[4*i + 2] = sha->h[i] >> 8;
+    digest[4*i + 3] = sha->h[i];
+  }
+}
+
+/**
+ * @brief Hashes the HMAC pads of a key, so that each HMAC of the PBKDF2
+ * iterations only hashes its message
+ * @param key : HMAC key, up to SHA1_BLOCK_LENGTH bytes
+ * @param len : key length
+ * @param inner : output, state after the inner pad
+ * @param outer : output, state after the outer pad
+ **/
+static void hmac_sha1_pads(const rsuint8 *key, rsuint16 len,
+                           Sha1Type *inner, Sha1Type *outer) {
+  rsuint8 pad[SHA1_BLOCK_LENGTH];
+  int i;
+
+  for (i = 0; i < SHA1_BLOCK_LENGTH; i++)
+    pad[i] = (i < len ? key[i] : 0) ^ 0x36;
+  sha1_init(inner);
+  sha1_update(inner, pad, SHA1_BLOCK_LENGTH);
+
+  for (i = 0; i < SHA1_BLOCK_LENGTH; i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+  sha1_init(outer);
+  sha1_update(outer, pad, SHA1_BLOCK_LENGTH);
+}
+
+/**
+ * @brief Computes an HMAC-SHA1, from the pads hashed by hmac_sha1_pads
+ * @param inner : state after the inner pad
+ * @param outer : state after the outer pad
+ * @param data : message
+ * @param len : message length
+ * @param mac : output, SHA1_LENGTH bytes. It can be the message.
+ **/
+static void hmac_sha1(const Sha1Type *inner, const Sha1Type *outer,
+                      const rsuint8 *data, rsuint16 len, rsuint8 *mac) {
+  Sha1Type sha = *inner;
+  sha1_update(&sha, data, len);
+  sha1_final(&sha, mac);
+
+  sha = *outer;
+  sha1_update(&sha, mac, SHA1_LENGTH);
+  sha1_final(&sha, mac);
+}
+
+/**
+ * @brief Derives the WPA PMK from the passphrase and the SSID, with
+ * PBKDF2-HMAC-SHA1 and PMK_ITERATIONS iterations, and replaces the key
+ * with the PMK in hex. It yields every PMK_CHUNK iterations, so that
+ * the other jobs keep running.
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param ap_info : AP info with the passphrase
+ **/
+static PT_THREAD(PtWifi_derive_PMK(struct pt *Pt, const RosMailType *Mail, ApInfoType *ap_info)) {
+  PmkStateType *st = &pmk_state;
+  int i;
+
+  PT_BEGIN(Pt);
+  hmac_sha1_pads(ap_info->Key, ap_info->KeyLength, &st->inner, &st->outer);
+
+  for (st->block = 1; st->block <= 2; st->block++) {
+    // U1 = HMAC(passphrase, SSID || block number)
+    Sha1Type sha = st->inner;
+    rsuint8 number[4] = {0, 0, 0, st->block};
+    sha1_update(&sha, ap_info->Ssid, strlen((char*)ap_info->Ssid));
+    sha1_update(&sha, number, sizeof(number));
+    sha1_final(&sha, st->u);
+    sha = st->outer;
+    sha1_update(&sha, st->u, SHA1_LENGTH);
+    sha1_final(&sha, st->u);
+    memcpy(st->t, st->u, SHA1_LENGTH);
+
+    for (st->iteration = 1; st->iteration < PMK_ITERATIONS;
+         st->iteration++) {
+      hmac_sha1(&st->inner, &st->outer, st->u, SHA1_LENGTH, st->u);
+      for (i = 0; i < SHA1_LENGTH; i++)
+        st->t[i] ^= st->u[i];
+
+      if (st->iteration % PMK_CHUNK == 0)
+        PT_DELAY(Pt, 1);
+    }
+    memcpy(st->pmk + (st->block - 1) * SHA1_LENGTH, st->t, SHA1_LENGTH);
+  }
+
+  for (i = 0; i < 2 * PMK_LENGTH; i++) {
+    rsuint8 digit = (i & 1) ? st->pmk[i / 2] & 15 : st->pmk[i / 2] >> 4;
+    ap_info->Key[i] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+  }
+  if (sizeof(ap_info->Key) > 2 * PMK_LENGTH)
+    ap_info->Key[2 * PMK_LENGTH] = 0;
+  ap_info->KeyLength = 2 * PMK_LENGTH;
+  memset(st, 0, sizeof(*st)); // Do not leave key material behind
+  PT_END(Pt);
+}
+
+/**
+ * @brief Setups an AP
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param ap_data : input configuration string. If NULL, it will use
+ * the data stored at the NVS to configure the AP
+ **/
+static PT_THREAD(PtWifi_setup_AP(struct pt *Pt, const RosMailType *Mail, rsuint8 *ap_data)) {
+  // Examples of AP data strings:
+  // "SSID\nWPA2\npassword\n"
+  // "SSID\nWPA2\password\nAES\n"  
+  
+  static struct pt childPt;
+  
+  PT_BEGIN(Pt);
+
+  ApInfoType *ap_info = &app_data.ap_info;
+  // Decode AP configuration, only if a config. string is given.
+  // If not, the default config (read from NVS at the beginning)
+  // will be used.
+  if (ap_data != NULL) {
+    if (!get_ap_info_from_str(ap_data, ap_info)) {
+      // Keep the current profile, rather than saving it as the new one
+      LOG_ERROR(LOG_AP_CONFIG_FAILED, 0, 0);
+      PT_EXIT(Pt);
+    }
+    app_data.key_is_pmk = (ap_info->KeyLength == 2 * PMK_LENGTH);
+  }
+
+  // Derive the PMK once, instead of at each association. Profiles
+  // stored with the passphrase are converted too.
+  if (app_data.ap_info.SecurityType != AWST_NONE && !app_data.key_is_pmk &&
+      app_data.ap_info.KeyLength >= 8 && app_data.ap_info.KeyLength <= 63) {
+    PT_SPAWN(Pt, &childPt, PtWifi_derive_PMK(&childPt, Mail,
+                                             &app_data.ap_info));
+    app_data.key_is_pmk = TRUE;
+    if (ap_data == NULL)
+      Wifi_save_appInfo_to_NVS();
+  }
+  ap_info = &app_data.ap_info; // Lost while spawned
+   
+  // Save AP information to NVS. Connect must be called afterwards
+  rsuint8 ssid_len = (rsuint8)strlen((char*)ap_info->Ssid);
+  
+  ApiWifiCipherInfoType cipher;
+  cipher.Ucipher = ap_info->Ucipher;
+  cipher.Mcipher = ap_info->Mcipher;
+  
+  AppWifiSetApInfo(0, ssid_len, ap_info->Ssid, ap_info->SecurityType,
+                   cipher, 0, ap_info->KeyLength, ap_info->Key);
+  AppWifiWriteApInfoToNvs();
+
+  // Store AP configuration, if a config. string is given
+  if (ap_data == NULL)
+    LOG_DEBUG(LOG_AP_FROM_NVS, 0, 0);
+  else {
+    // A lease or scan of the previous network is useless
+    app_data.lease.valid = 0;
+    scan_cache.valid = FALSE;
+    Wifi_save_appInfo_to_NVS();
+  }
+
+  // Disconnect, if associated to an old AP
+  wifi_wanted = FALSE;
+  if (AppWifiIsAssociated()) {
+    PT_SPAWN(Pt, &childPt, PtAppWifiDisconnect(&childPt, Mail));
+    if (IS_RECEIVED(API_WIFI_DISCONNECT_IND))
+      LOG_INFO(LOG_AP_DISCONNECTED, 0, 0);
+  }
+
+  PT_END(Pt);
+}
+
+/**
+ * @brief Suspends the WiFi chip
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_suspend(struct pt *Pt, const RosMailType *Mail)) {
+  PT_BEGIN(Pt);
+  is_suspended = true;
+  energy_update();
+  housekeeping_stop();
+  suspend_start = UPTIME_MS();
+  perf_flush(); // The node might not wake up again
+  POWER_TEST_PIN_TOGGLE;
+  SendApiWifiSuspendReq(COLA_TASK, 10*60*1000); // ms
+  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SUSPEND_CFM));
+  POWER_TEST_PIN_TOGGLE;
+  mcu_in_em2 = TRUE;
+  energy_update();
+  EMU_EnterEM2(); // uC enter suspend, too. Use an external interrupt to wake up!
+  mcu_in_em2 = FALSE;
+  energy_update();
+  PT_END(Pt);
+}
+
+
+/**
+ * @brief Resumes the suspended WiFi chip
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_resume(struct pt *Pt, const RosMailType *Mail)) {
+  PT_BEGIN(Pt);
+  POWER_TEST_PIN_TOGGLE;
+  SendApiWifiResumeReq(COLA_TASK);
+  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_RESUME_CFM));
+  POWER_TEST_PIN_TOGGLE;
+  is_suspended = false;
+  energy_update();
+  PERF_COUNT(suspended_time, (UPTIME_MS() - suspend_start) / 1000);
+  tx_queue_pump(); // Sends queued while suspended
+
+  // Open the upload session while the host reads its sensors
+  preconnect_pending = upload_target.preconnect && upload_target.name[0];
+  PT_END(Pt);
+}
+
+/**
+ * @brief Sets the powersave profile
+ * @param profile : powersave profile, 0: low power, 1: medium power,
+ * 2: high power, 3: max power
+ **/
+void Wifi_set_power_save_profile(rsuint8 profile) {
+  rsuint8 p;
+  switch (profile) {
+    case 0: p = POWER_SAVE_LOW_IDLE; break; // low power
+    case 1: p = POWER_SAVE_MEDIUM_IDLE; break; // medium power
+    case 2: p = POWER_SAVE_HIGH_IDLE; break; // high power
+    case 3: p = POWER_SAVE_MAX_POWER; break; // max power
+    default: p = 0xff;
+  }
+  
+  if (p != 0xff) {
+    AppWifiSetPowerSaveProfile(p);
+    wifi_power_save_profile = profile;
+    energy_update();
+  }
+}
+
+/**
+ * @brief Associates and connects to an already configured AP
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_connect(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+
+  PT_BEGIN(Pt);
+  
   if (!is_suspended) {
     Wifi_set_power_save_profile(3); // max power
     AppWifiSetTxPower(MAX_TX_POWER);
+    wifi_tx_power = MAX_TX_POWER;
     
     // Avoid corrupt SSID
     SendApiWifiSetSsidReq(COLA_TASK, 0, NULL);
     PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SET_SSID_CFM));
   
     // Read AP info
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("SendApiGetApinfoReq...");
-    #endif
     SendApiGetApinfoReq(COLA_TASK);
     PT_YIELD_UNTIL(Pt, IS_RECEIVED(API_GET_APINFO_CFM));
     
-    // Scan for known AP's
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("PtAppWifiScan...");
-    #endif
-    PT_SPAWN(Pt, &childPt, PtAppWifiScan(&childPt, Mail));
+    // Scan for known AP's, unless a recent scan found the same AP profile.
+    // This relies on the association using the AP list that the AppWifi
+    // layer keeps from its last scan (AppWifiIsApAvailable reads it), which
+    // API_WIFI_SET_SSID_REQ does not clear. The cache is dropped whenever
+    // that list may not match the profile any more: new AP config, power
+    // off and failed association, so the worst case is one failed attempt.
+    if (scan_cache_is_fresh(scan_cache_window) && scan_cache.ap_available) {
+      LOG_INFO(LOG_SCAN_CACHED, UPTIME_MS() - scan_cache.time, 0);
+    }
+    else {
+      LOG_DEBUG(LOG_SCAN_STARTED, 0, 0);
+      phase_begin(PHASE_SCAN);
+      PT_SPAWN(Pt, &childPt, PtAppWifiScan(&childPt, Mail));
+      phase_end(PHASE_SCAN);
+      scan_cache_store();
+    }
 
     // Connect to AP if it is available
     if (AppWifiIsApAvailable()) {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("AppWifiIsApAvailable: YES");
-      PRINTLN("PtWifi_connect spawning PtAppWifiConnect...");
-      #endif
+      LOG_DEBUG(LOG_ASSOCIATING, 0, 0);
 
       AppLedSetLedState(LED_STATE_CONNECTING);
 
       // Wait 1s
-      RosTimerStart(APP_PACKET_DELAY_TIMER, (1000 * RS_T1MS), &PacketDelayTimer);
-      PT_WAIT_UNTIL(Pt, IS_RECEIVED(APP_PACKET_DELAY_TIMEOUT));  
+      PT_DELAY(Pt, 1000);
       
+      // The association phase ends at API_WIFI_CONNECT_IND, which also
+      // starts the DHCP phase (see ColaTask)
+      phase_begin(PHASE_ASSOCIATE);
+      FAULT_DELAY(Pt, fault_config.assoc_delay);
       PT_SPAWN(Pt, &childPt, PtAppWifiConnect(&childPt, Mail));
       AppLedSetLedState(LED_STATE_IDLE);
+      if (!AppWifiIsAssociated())
+        phase_abort(PHASE_ASSOCIATE);
 
       // Wait 2s
-      RosTimerStart(APP_PACKET_DELAY_TIMER, (2000 * RS_T1MS), &PacketDelayTimer);
-      PT_WAIT_UNTIL(Pt, IS_RECEIVED(APP_PACKET_DELAY_TIMEOUT));  
+      PT_DELAY(Pt, 2000);
       
       if (AppWifiIsConnected()) {
         // Connected to AP
@@ -585,20 +2917,40 @@ static PT_THREAD(PtWifi_connect(struct pt *Pt, const RosMailType *Mail)) {
         print_IP_config();
         #endif
         PtMailHandled = TRUE;
+        PERF_COUNT(wifi_connects, 1);
+        if (boot_connected_time == 0)
+          boot_connected_time = UPTIME_MS();
+        if (sntp_flags & SNTP_AUTO)
+          sntp_pending = TRUE;
 
         // Update DNS client with default gateway addr
         SendApiDnsClientAddServerReq(COLA_TASK, AppWifiIpv4GetGateway(), AppWifiIpv6GetAddr()->Gateway);
+
+        // A restored lease does not configure the DNS given by DHCP
+        if (lease_in_use && app_data.lease.dns)
+          SendApiDnsClientAddServerReq(COLA_TASK, app_data.lease.dns, AppWifiIpv6GetAddr()->Gateway);
+
+        // The configured resolvers, also for the fallback resolution
+        if (dns_servers_configured()) {
+          int i;
+          for (i = 0; i < DNS_MAX_SERVERS; i++)
+            if (app_data.dns_servers[i] != 0)
+              SendApiDnsClientAddServerReq(COLA_TASK, app_data.dns_servers[i],
+                                           AppWifiIpv6GetAddr()->Gateway);
+        }
       }
       else {
-        #ifdef USE_LUART_TERMINAL
-        PRINTLN("Unable to connect");
-        #endif
+        LOG_ERROR(LOG_CONNECT_FAILED, 0, 0);
+        PERF_COUNT(wifi_failures, 1);
+        scan_cache.valid = FALSE; // Scan again at the next attempt
+        if (lease_in_use)
+          dhcp_lease_invalidate();
+        phase_abort(PHASE_ASSOCIATE);
+        phase_abort(PHASE_DHCP);
       }
     }
     else {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("AppWifiIsApAvailable: NO");
-      #endif
+      LOG_ERROR(LOG_AP_NOT_AVAILABLE, 0, 0);
       // Avoid to store a corrupt SSID
       SendApiWifiSetSsidReq(COLA_TASK, 0, NULL);
       PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SET_SSID_CFM));
@@ -622,28 +2974,34 @@ rsuint8 Wifi_is_connected() {
 void Wifi_TCP_close() {
   if (is_suspended)
     return;
+  tcp_wanted = FALSE;
   SendApiSocketCloseReq(COLA_TASK, socketHandle);
   socketHandle = 0;
+  tx_queue_flush();
 }
 
 /**
- * @brief Sends len bytes in tx_buffer using the TCP connection
- * @param len : number of bytes to send
+ * @brief Queues data to be sent using the TCP connection
+ * @param data : data to send
+ * @param len : number of bytes to send, up to TX_BUFFER_LENGTH
+ * @return sequence number of the send, 0 if the TX queue is full
  **/
-void Wifi_TCP_send(rsuint16 len) {
-  if (is_suspended)
-    return;
+rsuint8 Wifi_TCP_send(const rsuint8 *data, rsuint16 len) {
+  if (is_suspended || len > TX_BUFFER_LENGTH)
+    return 0;
 
-  #ifdef USE_LUART_TERMINAL
-  PRINTLN("Send...");
-  #endif
-  SendApiSocketSendReq(COLA_TASK, socketHandle, tx_buffer, len, 0);
+  TxEntryType *entry = tx_queue_alloc();
+  if (entry == NULL)
+    return 0;
+
+  memcpy(entry->data, data, len);
+  time_stamp(entry->data, len);
+  return tx_queue_commit(entry, len);
 }
 
 /**
- * @brief Receive data in the RX buffer. Must be called by the user when
- * it polls the status and sees that TCP_received is activated.
- * @param len : number of bytes to send
+ * @brief Reads and prints the received data. Must be called by the user
+ * when it polls the status and sees that TCP_received is activated.
  **/
 char Wifi_TCP_receive() {
   if (is_suspended)
@@ -656,6 +3014,11 @@ char Wifi_TCP_receive() {
     return false;
   }
 
+  rsuint8 *rx_buffer = pool_alloc();
+  if (rx_buffer == NULL)
+    return false;
+  TCP_Rx_bufferLength = rx_queue_read(rx_buffer, TX_BUFFER_LENGTH);
+
   #ifdef USE_LUART_TERMINAL
   sprintf(TmpStr, "TCP received BufferLength: %d", TCP_Rx_bufferLength);
   PRINTLN(TmpStr);
@@ -669,10 +3032,7 @@ char Wifi_TCP_receive() {
   PRINTLN("");
   #endif
 
-  SendApiSocketFreeBufferReq(COLA_TASK,
-                             socketHandle,
-                             TCP_receive_buffer_ptr);
-  TCP_received = false; // clear flag
+  pool_free(rx_buffer);
   return true;
 }
 
@@ -690,6 +3050,38 @@ rsuint8 Wifi_get_status() {
   return status;
 }
 
+/**
+ * @brief Builds the extended status block (see command #25)
+ * @param buffer : output buffer
+ * @return number of bytes written
+ **/
+static rsuint16 Wifi_get_extended_status(rsuint8 *buffer) {
+  rsuint8 *p = buffer;
+  rsuint8 flags = Wifi_get_status();
+  flags |= ((in_outage & 1) << 4);
+  flags |= ((lease_in_use & 1) << 5);
+  flags |= ((booting & 1) << 6);
+  flags |= ((rx_overflow & 1) << 7);
+
+  *p++ = flags;
+  *p++ = (rsuint8)wifi_rssi;
+  p = put_u16(p, rx_pending);
+  *p++ = tx_queue_free();
+  p = put_u16(p, tx_queue_free() * TX_BUFFER_LENGTH);
+  p = put_u32(p, Wifi_is_connected() ? AppWifiIpv4GetAddress() : 0);
+  *p++ = wifi_power_save_profile;
+  *p++ = wifi_tx_power;
+  *p++ = last_send_status;
+  *p++ = last_dns_status;
+  *p++ = tx_done_seq;
+  *p++ = tx_failed_seq;
+  p = put_u32(p, UPTIME_MS() / 1000);
+  p = put_u32(p, bytes_sent);
+  p = put_u32(p, bytes_received);
+  p = put_u32(p, boot_connected_time);
+  return (rsuint16)(p - buffer);
+}
+
 /**
  * @brief Sets the transmit wireless transmit power
  * @param power : wireless transmit power
@@ -697,236 +3089,1075 @@ rsuint8 Wifi_get_status() {
 void Wifi_set_tx_power(rsuint8 power) {
   if (power > MAX_TX_POWER)
     power = MAX_TX_POWER;
+  energy_update(); // Charge the past sends at the old power
   AppWifiSetTxPower(power);
+  wifi_tx_power = power;
+}
+
+/**
+ * @brief Disassociates and disconnects from the WiFi AP
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_disconnect(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+  PT_BEGIN(Pt);  
+  wifi_wanted = FALSE;
+  tcp_wanted = FALSE;
+  PT_SPAWN(Pt, &childPt, PtAppWifiDisconnect(&childPt, Mail));
+  PT_END(Pt);
+}
+
+/**
+ * @brief Configures the IP connection (DHCP, static)
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param config : configuration string. NULL to read configuration from
+ * the NVS
+ **/
+static PT_THREAD(PtWifi_IP_config(struct pt *Pt, const RosMailType *Mail, rsuint8 *config)) {
+  static const char *ip_format = "%d.%d.%d.%d";
+  static char buffer[30];
+
+  PT_BEGIN(Pt);
+  
+  // Read IP config parameters
+  char load_from_NVS = (config == NULL);
+  if (load_from_NVS) {
+    LOG_DEBUG(LOG_IP_FROM_NVS, 0, 0);
+    Wifi_read_appInfo_from_NVS();
+  }
+  else {
+    app_data.use_dhcp = (config[0] == 'd' || config[0] == 'D');
+
+    if (!app_data.use_dhcp) {
+      // Extract IP address
+      sprintf(buffer, ip_format, config[1], config[2], config[3], config[4]);
+      inet_aton(buffer, &app_data.static_address.Ip.V4.Addr);
+
+      // Extract subnet
+      sprintf(buffer, ip_format, config[5], config[6], config[7], config[8]);
+      inet_aton(buffer, &app_data.static_subnet.Ip.V4.Addr);
+      
+      // Extract gateway
+      sprintf(buffer, ip_format, config[9], config[10], config[11], config[12]);
+      inet_aton(buffer, &app_data.static_gateway.Ip.V4.Addr);
+    }
+
+    // Store IP config information to NVS
+    Wifi_save_appInfo_to_NVS();
+  }
+
+  // Once the config has been read, do IP config now
+  lease_in_use = FALSE;
+  if (app_data.use_dhcp && dhcp_lease_usable()) {
+    // Restore the cached lease, skipping the DHCP exchange. If it does
+    // not work, dhcp_lease_invalidate() goes back to DHCP.
+    LOG_INFO(LOG_LEASE_RESTORED, app_data.lease.address, 0);
+    AppWifiIpv4Config(TRUE, app_data.lease.address,
+                            app_data.lease.subnet,
+                            app_data.lease.gateway, 0);
+    lease_in_use = TRUE;
+  }
+  else if (app_data.use_dhcp) {
+    // DHCP
+    LOG_INFO(LOG_DHCP_STARTED, 0, 0);
+    AppWifiIpv4Config(FALSE, 0, 0, 0, 0);
+    if (AppWifiIsConnected()) {
+      phase_begin(PHASE_DHCP);
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(APP_EVENT_IP_ADDR_RECEIVED) ||
+                        IS_RECEIVED(API_WIFI_DISCONNECT_IND));
+    }
+  }
+  else {
+    // Static IP address
+    LOG_INFO(LOG_STATIC_IP, app_data.static_address.Ip.V4.Addr,
+             app_data.static_gateway.Ip.V4.Addr);
+
+    AppWifiIpv4Config(TRUE, app_data.static_address.Ip.V4.Addr,
+                            app_data.static_subnet.Ip.V4.Addr,
+                            app_data.static_gateway.Ip.V4.Addr, 0);
+    AppWifiWriteStaticIpToNvs();
+  }
+
+  PT_END(Pt);
+}
+
+/**
+ * @brief Builds a DNS query for the A record of a name
+ * @param buffer : output buffer, DNS_QUERY_LENGTH bytes
+ * @param id : query identifier
+ * @param name : domain name, shorter than DNS_NAME_LENGTH
+ * @return number of bytes written
+ **/
+static rsuint16 dns_build_query(rsuint8 *buffer, rsuint16 id,
+                                const rsuint8 *name) {
+  rsuint8 *p = buffer;
+  rsuint8 *label;
+
+  memset(buffer, 0, DNS_HEADER_LENGTH);
+  buffer[0] = id >> 8;
+  buffer[1] = id & 0xff;
+  buffer[2] = 0x01; // Recursion desired
+  buffer[5] = 1;    // One question
+  p += DNS_HEADER_LENGTH;
+
+  // Labels, each one prefixed with its length
+  label = p++;
+  *label = 0;
+  for (; *name; name++) {
+    if (*name == '.') {
+      label = p++;
+      *label = 0;
+    }
+    else {
+      *p++ = *name;
+      (*label)++;
+    }
+  }
+  *p++ = 0;
+
+  // Type A, class IN
+  *p++ = 0; *p++ = 1;
+  *p++ = 0; *p++ = 1;
+  return (rsuint16)(p - buffer);
+}
+
+/**
+ * @brief Skips a possibly compressed name of a DNS message
+ * @param msg : DNS message
+ * @param pos : position of the name
+ * @param len : length of the message
+ * @return position after the name, or len if it is truncated
+ **/
+static rsuint16 dns_skip_name(const rsuint8 *msg, rsuint16 pos, rsuint16 len) {
+  while (pos < len) {
+    if (msg[pos] == 0)
+      return pos + 1;
+    if ((msg[pos] & 0xC0) == 0xC0)
+      return pos + 2; // Pointer, the end of the name
+    pos += msg[pos] + 1;
+  }
+  return len;
+}
+
+/**
+ * @brief Takes the first A record of a DNS response
+ * @param msg : DNS message
+ * @param len : length of the message
+ * @param id : identifier of the query
+ * @param o_ttl : TTL of the record, in seconds
+ * @return IP address, 0 if the response has no A record
+ **/
+static rsuint32 dns_parse_response(const rsuint8 *msg, rsuint16 len,
+                                   rsuint16 id, rsuint32 *o_ttl) {
+  rsuint16 pos, answers;
+  rsuint32 address = 0;
+
+  if (len < DNS_HEADER_LENGTH || msg[0] != (id >> 8) ||
+      msg[1] != (id & 0xff) || !(msg[2] & 0x80) || (msg[3] & 0x0f) != 0)
+    return 0; // Not our response, or an error
+  answers = (msg[6] << 8) | msg[7];
+
+  // Skip the question
+  pos = dns_skip_name(msg, DNS_HEADER_LENGTH, len) + 4;
+
+  while (answers-- > 0) {
+    rsuint16 type, rdlength;
+    pos = dns_skip_name(msg, pos, len);
+    if (pos + 10 > len)
+      return 0;
+    type = (msg[pos] << 8) | msg[pos + 1];
+    rdlength = (msg[pos + 8] << 8) | msg[pos + 9];
+    pos += 10; // Type, class, TTL and length
+    if (pos + rdlength > len)
+      return 0;
+    if (type == 1 && rdlength == 4) {
+      memcpy(&address, msg + pos, 4); // In network order, as inet_aton
+      *o_ttl = ((rsuint32)msg[pos - 6] << 24) | ((rsuint32)msg[pos - 5] << 16) |
+               ((rsuint32)msg[pos - 4] << 8) | msg[pos - 3];
+      return address;
+    }
+    pos += rdlength; // CNAME, for example
+  }
+  return 0;
+}
+
+/**
+ * @brief Sends the same query to all the configured resolvers over UDP.
+ * The first answer wins. The round trip of each server is smoothed, and
+ * doubled when it does not answer in time.
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param name : domain name to resolve
+ **/
+static PT_THREAD(PtDns_race(struct pt *Pt, const RosMailType *Mail, rsuint8 *name)) {
+  static rsuint16 id, len, timeout;
+  static rsuint32 sent;
+  static rsuint8 pending; // Bit i: waiting for server i
+  ApiSocketAddrType addr;
+  int i;
+
+  PT_BEGIN(Pt);
+  dns_race_address = 0;
+  if (strlen((char*)name) >= DNS_NAME_LENGTH)
+    PT_EXIT(Pt);
+
+  PT_WAIT_UNTIL(Pt, !udp_busy);
+  udp_busy = TRUE;
+  SendApiSocketCreateReq(COLA_TASK, ASD_AF_INET, AST_DGRAM, ASP_IPPROTO_UDP);
+  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_SOCKET_CREATE_CFM));
+  if (((ApiSocketCreateCfmType *)Mail)->Status != RSS_SUCCESS) {
+    udp_busy = FALSE;
+    PT_EXIT(Pt);
+  }
+  udp_socket = ((ApiSocketCreateCfmType *)Mail)->Handle;
+
+  id = (rsuint16)(UPTIME_MS() ^ (UPTIME_MS() >> 16));
+  len = dns_build_query(dns_query, id, name);
+
+  addr.Domain = ASD_AF_INET;
+  addr.Port = DNS_PORT;
+  pending = 0;
+  timeout = DNS_MIN_TIMEOUT;
+  for (i = 0; i < DNS_MAX_SERVERS; i++) {
+    if (app_data.dns_servers[i] == 0)
+      continue;
+    addr.Ip.V4.Addr = app_data.dns_servers[i];
+    SendApiSocketSendToReq(COLA_TASK, udp_socket, dns_query, len, 0, addr);
+    pending |= 1 << i;
+    if (2 * dns_rtt[i] > timeout)
+      timeout = 2 * dns_rtt[i];
+  }
+  if (timeout > DNS_MAX_TIMEOUT)
+    timeout = DNS_MAX_TIMEOUT;
+  sent = UPTIME_MS();
+  RosTimerStart(APP_DNS_RSP_TIMER, timeout * RS_T1MS, &DnsRspTimer);
+
+  udp_waiting = TRUE;
+  while (pending != 0 && dns_race_address == 0) {
+    PT_WAIT_UNTIL(Pt, (IS_RECEIVED(API_SOCKET_RECEIVE_FROM_IND) &&
+                       ((ApiSocketReceiveFromIndType *)Mail)->Handle ==
+                       udp_socket) ||
+                      (IS_RECEIVED(APP_DNS_RSP_TIMEOUT) && !PtMailHandled));
+    if (IS_RECEIVED(APP_DNS_RSP_TIMEOUT)) {
+      PtMailHandled = TRUE;
+      break;
+    }
+
+    ApiSocketReceiveFromIndType *ind = (ApiSocketReceiveFromIndType *)Mail;
+    for (i = 0; i < DNS_MAX_SERVERS; i++) {
+      if ((pending & (1 << i)) &&
+          ind->SrcAddr.Ip.V4.Addr == app_data.dns_servers[i]) {
+        rsuint16 rtt = (rsuint16)(UPTIME_MS() - sent);
+        dns_rtt[i] = (7 * dns_rtt[i] + rtt) / 8;
+        pending &= ~(1 << i);
+        dns_race_answered = TRUE;
+        dns_race_address = dns_parse_response(ind->BufferPtr,
+                                              ind->BufferLength, id,
+                                              &dns_race_ttl);
+        if (dns_race_address != 0)
+          dns_wins[i]++;
+        break;
+      }
+    }
+    SendApiSocketFreeBufferReq(COLA_TASK, udp_socket, ind->BufferPtr);
+  }
+  udp_waiting = FALSE;
+  RosTimerStop(APP_DNS_RSP_TIMER);
+
+  // Servers which did not answer in time
+  for (i = 0; i < DNS_MAX_SERVERS; i++) {
+    if ((pending & (1 << i)) && dns_race_address == 0) {
+      dns_rtt[i] *= 2;
+      if (dns_rtt[i] > DNS_MAX_TIMEOUT)
+        dns_rtt[i] = DNS_MAX_TIMEOUT;
+    }
+  }
+
+  SendApiSocketCloseReq(COLA_TASK, udp_socket);
+  udp_busy = FALSE;
+  PT_END(Pt);
+}
+
+/**
+ * @brief Resolves a domain name. The configured resolvers are raced
+ * over UDP first, and the DNS service of the stack is the fallback.
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param name : domain name to resolve
+ * @param o_response : resolved IP address
+ **/
+static PT_THREAD(PtWifi_DNS_resolve(struct pt *Pt, const RosMailType *Mail, rsuint8 *name, rsuint32 *o_response)) {
+  static struct pt childPt;
+  *o_response = 0;
+  
+  PT_BEGIN(Pt);
+
+  // Answer from the cache if the name was resolved recently
+  *o_response = dns_cache_lookup(name);
+  if (*o_response != 0)
+    PT_EXIT(Pt);
+
+  FAULT_DELAY(Pt, fault_config.dns_delay);
+  if (FAULT_ROLL(fault_config.dns_fail)) {
+    #ifdef FAULT_INJECTION
+    fault_count[0]++;
+    #endif
+    last_dns_status = RSS_FAILED;
+    LOG_ERROR(LOG_DNS_FAILED, last_dns_status, 0);
+    PERF_COUNT(dns_failures, 1);
+    PT_EXIT(Pt);
+  }
+ 
+  phase_begin(PHASE_DNS);
+  dns_race_answered = FALSE;
+  if (dns_servers_configured()) {
+    PT_SPAWN(Pt, &childPt, PtDns_race(&childPt, Mail, name));
+    *o_response = dns_race_address;
+    if (*o_response != 0) {
+      last_dns_status = RSS_SUCCESS;
+      dns_cache_store(name, *o_response, dns_race_ttl);
+    }
+  }
+
+  if (*o_response == 0) {
+    SendApiDnsClientResolveReq(COLA_TASK, 0, strlen((char*)name), name);
+
+    // Wait for response from DNS Client
+    RosTimerStart(APP_DNS_RSP_TIMER, APP_DNS_RESOLVE_RSP_TIMEOUT, &DnsRspTimer);
+
+    PT_WAIT_UNTIL(Pt, (IS_RECEIVED(API_DNS_CLIENT_RESOLVE_CFM) ||
+                       IS_RECEIVED(APP_DNS_RSP_TIMEOUT)) &&
+                       !PtMailHandled);
+    PtMailHandled = TRUE;
+    if (IS_RECEIVED(API_DNS_CLIENT_RESOLVE_CFM)) {
+      RosTimerStop(APP_DNS_RSP_TIMER);
+      last_dns_status = (rsuint8)((ApiDnsClientResolveCfmType *)Mail)->Status;
+      if (((ApiDnsClientResolveCfmType *)Mail)->Status == RSS_SUCCESS) {
+        // Store the resolved IP (a 32-bit unsigned integer)
+        *o_response = (rsuint32)((ApiDnsClientResolveCfmType *)Mail)->IpV4;
+        dns_cache_store(name, *o_response, 0);
+      }
+      else {
+        LOG_ERROR(LOG_DNS_FAILED, last_dns_status, 0);
+      }
+    }
+    else {
+      LOG_WARNING(LOG_DNS_TIMEOUT, 0, 0);
+      last_dns_status = RSS_NO_DATA;
+    }
+  }
+
+  if (*o_response != 0) {
+    phase_end(PHASE_DNS);
+    LOG_INFO(LOG_DNS_RESOLVED, *o_response, 0);
+  }
+  else
+    PERF_COUNT(dns_failures, 1);
+
+  // The restored lease might be stale if no resolver answers at all. An
+  // answer, even an error such as NXDOMAIN, shows that the network works.
+  if (*o_response == 0 && lease_in_use && last_dns_status == RSS_NO_DATA &&
+      !dns_race_answered)
+    dhcp_lease_invalidate();
+  phase_abort(PHASE_DNS); // No effect if the resolution succeeded
+
+  PT_END(Pt);
+}
+
+/**
+ * @brief Event handled. Fired when the TCP connection has been
+ * stablished
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_TCP_on_connect(struct pt *Pt, const RosMailType *Mail)) {
+  AppSocketDataType *pInst = (AppSocketDataType *)PtInstDataPtr;
+  socketHandle = pInst->SocketHandle;
+
+  PT_BEGIN(Pt);
+  LOG_INFO(LOG_TCP_CONNECTED, socketHandle, 0);
+  
+  TCP_is_connected = true;
+  PERF_COUNT(tcp_connects, 1);
+  tcp_wanted = TRUE; // Reopened by the supervisor if lost
+  phase_end(PHASE_TCP_CONNECT);
+                     
+  // Do not exit from the protothread until the TCP socket is closed
+  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_SOCKET_CLOSE_IND));
+  
+  PT_END(Pt);
+}
+
+/**
+ * @brief Starts a new TCP connection to the given server
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param addr : server IP address and TCP port
+ **/
+static PT_THREAD(PtWifi_TCP_start(struct pt *Pt, const RosMailType *Mail, ApiSocketAddrType addr)) {
+  PT_BEGIN(Pt);
+  
+  if (!is_suspended) {
+    TCP_is_connected = false;
+    tcp_target = addr;
+    rx_queue_flush(); // Drop data left by the previous connection
+    tx_queue_flush(); // And sends queued for it
+    encode_prev_length = 0; // The server decodes each session apart
+    
+    phase_begin(PHASE_TCP_CONNECT);
+    FAULT_DELAY(Pt, fault_config.tcp_delay);
+    // A failed connection is logged when its socket is closed
+    AppSocketStartTcpClient(&PtList, addr, PtWifi_TCP_on_connect);  
+  }
+
+  PT_END(Pt);
+}
+
+/**
+ * @brief Snapshots the association state before a warm power off
+ **/
+static void warm_state_save(void) {
+  warm_state.associated = Wifi_is_connected();
+  warm_state.tcp_connected = TCP_is_connected;
+  warm_state.tcp_target = tcp_target;
+  warm_state.power_save_profile = wifi_power_save_profile;
+  warm_state.tx_power = wifi_tx_power;
+
+  // Keep the current DHCP lease, so that it can be restored directly. It
+  // keeps the time of its DHCP exchange, not of the power off.
+  if (warm_state.associated && app_data.use_dhcp && !lease_in_use &&
+      AppWifiIpv4GetAddress() != 0 && dhcp_acquired_ms != 0)
+    dhcp_lease_store();
+
+  // And the resolved names
+  dns_cache_pin(NULL);
+
+  warm_state.valid = TRUE;
+}
+
+/**
+ * @brief Replays the state saved by warm_state_save after a power on:
+ * AP setup, IP config, association, radio settings and TCP session
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtWifi_warm_restore(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+
+  PT_BEGIN(Pt);
+  LOG_INFO(LOG_WARM_RESTORE, 0, 0);
+  warm_state.valid = FALSE;
+
+  PT_SPAWN(Pt, &childPt, PtWifi_setup_AP(&childPt, Mail, NULL));
+
+  lease_warm = TRUE;
+  PT_SPAWN(Pt, &childPt, PtWifi_IP_config(&childPt, Mail, NULL));
+  lease_warm = FALSE;
+
+  if (warm_state.associated) {
+    PT_SPAWN(Pt, &childPt, PtWifi_connect(&childPt, Mail));
+    wifi_wanted = Wifi_is_connected();
+
+    // PtWifi_connect selects the max power, restore the previous one
+    Wifi_set_power_save_profile(warm_state.power_save_profile);
+    Wifi_set_tx_power(warm_state.tx_power);
+
+    if (warm_state.tcp_connected && Wifi_is_connected())
+      PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail,
+                                              warm_state.tcp_target));
+  }
+
+  PT_END(Pt);
 }
 
 /**
  * @brief Powers on/off the WiFi chip
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
- * @param on : true for poweron, false for poweroff
+ * @param on : 1 for poweron, 0 for poweroff, POWER_OFF_WARM for
+ * poweroff keeping the state to restore at the next poweron
  **/
 static PT_THREAD(PtWifi_power_on_off(struct pt *Pt,
                  const RosMailType *Mail,
                  char on)) {
   static struct pt childPt;
-  #ifdef USE_LUART_TERMINAL
-  PRINTLN("SPAWN PtWifi_power_on_off");
-  #endif
 
   PT_BEGIN(Pt);
-  if (on)
+  LOG_INFO(LOG_WIFI_POWER, on, 0);
+  if (on != 0 && on != POWER_OFF_WARM) {
     PT_SPAWN(Pt, &childPt, PtAppWifiPowerOn(&childPt, Mail));
-  else
+    wifi_powered = TRUE;
+    energy_update();
+    if (warm_state.valid)
+      PT_SPAWN(Pt, &childPt, PtWifi_warm_restore(&childPt, Mail));
+  }
+  else {
+    if (on == POWER_OFF_WARM)
+      warm_state_save();
+    else
+      warm_state.valid = FALSE;
+    wifi_wanted = FALSE;
+    tcp_wanted = FALSE;
     PT_SPAWN(Pt, &childPt, PtAppWifiPowerOff(&childPt, Mail));
+    wifi_powered = FALSE;
+    energy_update();
+    TCP_is_connected = false; // The socket is lost
+    socketHandle = 0;
+    tx_queue_flush();
+    scan_cache.valid = FALSE;
+  }
+  PT_END(Pt);
+}
+
+/**
+ * @brief Background job which refreshes the scan cache while associated
+ * and idle, at a low duty cycle
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtBackgroundScan(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+
+  PT_BEGIN(Pt);
+  while (1) {
+    PT_WAIT_UNTIL(Pt, HOUSEKEEPING_TICK &&
+                      scan_background_interval != 0 &&
+                      !radio_busy && !is_suspended &&
+                      Wifi_is_connected() && tx_queue_count == 0 &&
+                      !scan_cache_is_fresh(scan_background_interval));
+    radio_busy = TRUE;
+    PT_SPAWN(Pt, &childPt, PtAppWifiScan(&childPt, Mail));
+    scan_cache_store();
+    radio_busy = FALSE;
+  }
   PT_END(Pt);
 }
 
 /**
- * @brief Disassociates and disconnects from the WiFi AP
+ * @brief Checks if the association or the TCP session requested by the
+ * host has been lost
+ **/
+static rsbool link_is_lost(void) {
+  return (wifi_wanted && !Wifi_is_connected()) ||
+         (tcp_wanted && !TCP_is_connected);
+}
+
+/**
+ * @brief Background job which detects the loss of the association or
+ * the TCP session, and reconnects with exponential backoff
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
  **/
-static PT_THREAD(PtWifi_disconnect(struct pt *Pt, const RosMailType *Mail)) {
+static PT_THREAD(PtSupervisor(struct pt *Pt, const RosMailType *Mail)) {
   static struct pt childPt;
-  PT_BEGIN(Pt);  
-  PT_SPAWN(Pt, &childPt, PtAppWifiDisconnect(&childPt, Mail));
+  static rsuint32 outage_start, next_attempt, deadline;
+  static rsuint16 backoff;
+
+  PT_BEGIN(Pt);
+  while (1) {
+    PT_WAIT_UNTIL(Pt, HOUSEKEEPING_TICK &&
+                      supervisor_enabled && !is_suspended && !radio_busy &&
+                      link_is_lost());
+    LOG_WARNING(LOG_LINK_LOST, 0, 0);
+    PERF_COUNT(link_losses, 1);
+    in_outage = TRUE;
+    outage_start = UPTIME_MS();
+    next_attempt = outage_start;
+    backoff = SUPERVISOR_MIN_BACKOFF;
+
+    while (in_outage) {
+      PT_WAIT_UNTIL(Pt, HOUSEKEEPING_TICK &&
+                        !radio_busy &&
+                        (TIME_REACHED(next_attempt) || !link_is_lost()));
+      if (!supervisor_enabled || is_suspended)
+        break; // Recovery is now up to the host
+
+      if (link_is_lost()) {
+        radio_busy = TRUE;
+        outage_stats.attempts++;
+
+        if (wifi_wanted && !Wifi_is_connected())
+          PT_SPAWN(Pt, &childPt, PtWifi_connect(&childPt, Mail));
+
+        if (tcp_wanted && !TCP_is_connected && Wifi_is_connected()) {
+          PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail,
+                                                  tcp_target));
+          deadline = UPTIME_MS() + SUPERVISOR_TCP_TIMEOUT;
+          PT_WAIT_UNTIL_TIME(Pt, TCP_is_connected, deadline);
+        }
+        radio_busy = FALSE;
+      }
+
+      if (link_is_lost()) {
+        next_attempt = UPTIME_MS() + backoff * 1000UL;
+        backoff *= 2;
+        if (backoff > supervisor_max_backoff)
+          backoff = supervisor_max_backoff;
+      }
+      else {
+        rsuint32 duration = UPTIME_MS() - outage_start;
+        outage_stats.count++;
+        outage_stats.last = duration;
+        outage_stats.total += duration;
+        if (duration > outage_stats.max)
+          outage_stats.max = duration;
+        LOG_INFO(LOG_LINK_RECOVERED, duration, 0);
+        in_outage = FALSE;
+      }
+    }
+    in_outage = FALSE;
+  }
   PT_END(Pt);
 }
 
 /**
- * @brief Configures the IP connection (DHCP, static)
+ * @brief Fetches a document with a conditional HTTP GET, using the open
+ * TCP session. The validator and the hash of the last document are kept
+ * at the NVS with its body, which is only written again if it changed.
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
- * @param config : configuration string. NULL to read configuration from
- * the NVS
+ * @param host : server name, for the Host header
+ * @param path : document path
+ * @param body : buffer for the body, HTTP_CACHE_BODY_LENGTH bytes
+ * @param o_result : outcome of the request
  **/
-static PT_THREAD(PtWifi_IP_config(struct pt *Pt, const RosMailType *Mail, rsuint8 *config)) {
-  static const char *ip_format = "%d.%d.%d.%d";
-  static char buffer[30];
+static PT_THREAD(PtHttp_get(struct pt *Pt, const RosMailType *Mail,
+                            const char *host, const char *path,
+                            rsuint8 *body, HttpResultType *o_result)) {
+  static TxEntryType *entry;
+  static rsuint32 id;
+  static rsuint32 deadline;
+  static rsuint8 chunk[64];
 
   PT_BEGIN(Pt);
-  
-  // Read IP config parameters
-  char load_from_NVS = (config == NULL);
-  if (load_from_NVS) {
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Reading IP config info from NVS");
-    #endif
-    Wifi_read_appInfo_from_NVS();
+  memset(o_result, 0, sizeof(*o_result));
+  o_result->result = HTTP_RESULT_FAILED;
+  if (!TCP_is_connected)
+    PT_EXIT(Pt);
+  if (rx_pending > 0) {
+    // The response would be mixed with data the host did not read
+    o_result->result = HTTP_RESULT_RX_PENDING;
+    PT_EXIT(Pt);
   }
-  else {
-    app_data.use_dhcp = (config[0] == 'd' || config[0] == 'D');
-
-    if (!app_data.use_dhcp) {
-      // Extract IP address
-      sprintf(buffer, ip_format, config[1], config[2], config[3], config[4]);
-      inet_aton(buffer, &app_data.static_address.Ip.V4.Addr);
-      #ifdef USE_LUART_TERMINAL
-      sprintf(TmpStr, "IP address: %s", buffer); PRINTLN(TmpStr);
-      #endif
 
-      // Extract subnet
-      sprintf(buffer, ip_format, config[5], config[6], config[7], config[8]);
-      inet_aton(buffer, &app_data.static_subnet.Ip.V4.Addr);
-      #ifdef USE_LUART_TERMINAL
-      sprintf(TmpStr, "Subnet: %s", buffer); PRINTLN(TmpStr);    
-      #endif
-      
-      // Extract gateway
-      sprintf(buffer, ip_format, config[9], config[10], config[11], config[12]);
-      inet_aton(buffer, &app_data.static_gateway.Ip.V4.Addr);
-      #ifdef USE_LUART_TERMINAL
-      sprintf(TmpStr, "Gateway: %s", buffer); PRINTLN(TmpStr);
-      #endif
+  // Build the request, with the validator of the cached document
+  http_cache_load();
+  entry = tx_queue_alloc();
+  PT_WAIT_UNTIL(Pt, entry != NULL ||
+                    (tx_queue_free() > 0 && (entry = tx_queue_alloc()) != NULL));
+  // HTTP/1.0, so that the server neither keeps the session open nor
+  // sends a chunked body
+  sprintf((char*)entry->data,
+          "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n", path, host);
+  if (http_cache.valid && http_cache.validator_type == HTTP_VALIDATOR_ETAG)
+    sprintf((char*)entry->data + strlen((char*)entry->data),
+            "If-None-Match: %s\r\n", http_cache.validator);
+  else if (http_cache.valid &&
+           http_cache.validator_type == HTTP_VALIDATOR_DATE)
+    sprintf((char*)entry->data + strlen((char*)entry->data),
+            "If-Modified-Since: %s\r\n", http_cache.validator);
+  strcat((char*)entry->data, "\r\n");
+
+  tx_queue_commit(entry, strlen((char*)entry->data));
+  id = tx_last_id;
+  deadline = UPTIME_MS() + HTTP_TIMEOUT;
+
+  // Parse the response as it arrives
+  http_parse_init(&http_parser);
+  while (http_parser.state != HTTP_PARSE_DONE) {
+    PT_WAIT_UNTIL_TIME(Pt, rx_pending > 0 || !TCP_is_connected ||
+                           tx_failed_id == id, deadline);
+    if (rx_pending == 0) {
+      // Without Content-Length, the body ends when the server closes
+      if (!TCP_is_connected && http_parser.state == HTTP_PARSE_BODY &&
+          !http_parser.has_length)
+        break;
+      PT_EXIT(Pt);
     }
-
-    // Store IP config information to NVS
-    Wifi_save_appInfo_to_NVS();
+    rsuint16 len = rx_queue_read(chunk, sizeof(chunk));
+    http_parse(&http_parser, chunk, len, body);
   }
+  rx_queue_flush(); // Drop the rest of the response
 
-  // Once the config has been read, do IP config now
-  if (app_data.use_dhcp) {
-    // DHCP
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Do DHCP");
-    #endif
-    AppWifiIpv4Config(FALSE, 0, 0, 0, 0);
-    if (AppWifiIsConnected())
-      PT_WAIT_UNTIL(Pt, IS_RECEIVED(APP_EVENT_IP_ADDR_RECEIVED) ||
-                        IS_RECEIVED(API_WIFI_DISCONNECT_IND));
+  o_result->status = http_parser.status;
+  if (http_parser.status == 304 && http_cache.valid) {
+    o_result->result = HTTP_RESULT_NOT_MODIFIED;
+    o_result->length = http_cache.length;
+    o_result->hash = http_cache.hash;
+  }
+  else if (http_parser.status != 200) {
+    o_result->result = HTTP_RESULT_HTTP_ERROR;
+  }
+  else if (http_parser.chunked) {
+    o_result->result = HTTP_RESULT_CHUNKED;
+  }
+  else if (http_parser.body_length > HTTP_CACHE_BODY_LENGTH) {
+    o_result->result = HTTP_RESULT_TOO_LARGE;
+    o_result->hash = http_parser.hash;
   }
   else {
-    // Static IP address
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("Do static IP");
+    rsbool same_body = http_cache.valid &&
+                       http_cache.hash == http_parser.hash &&
+                       http_cache.length == http_parser.body_length;
+    rsbool same_validator =
+      http_cache.validator_type == http_parser.validator_type &&
+      !strcmp((char*)http_cache.validator, (char*)http_parser.validator);
+
+    o_result->length = (rsuint16)http_parser.body_length;
+    o_result->hash = http_parser.hash;
+    o_result->result = same_body ? HTTP_RESULT_SAME_BODY : HTTP_RESULT_CHANGED;
+
+    // Save the flash from needless writes
+    if (!same_body || !same_validator) {
+      http_cache.valid = HTTP_CACHE_MAGIC;
+      http_cache.validator_type = http_parser.validator_type;
+      strcpy((char*)http_cache.validator, (char*)http_parser.validator);
+      http_cache.length = o_result->length;
+      http_cache.hash = o_result->hash;
+      if (!same_body)
+        NvsWrite(HTTP_CACHE_NVS_OFFSET + sizeof(http_cache),
+                 http_cache.length, body);
+      NvsWrite(HTTP_CACHE_NVS_OFFSET, sizeof(http_cache),
+               (rsuint8*)&http_cache);
+    }
+  }
 
-    // Print IP address
-    inet_ntoa(app_data.static_address.Ip.V4.Addr, buffer);
-    sprintf(TmpStr, "IP address: %s", buffer); PRINTLN(TmpStr);
+  PT_END(Pt);
+}
 
-    // Print subnet
-    inet_ntoa(app_data.static_subnet.Ip.V4.Addr, buffer);
-    sprintf(TmpStr, "Subnet: %s", buffer); PRINTLN(TmpStr);    
+/**
+ * @brief Checks if the TCP session is open or being opened to a server
+ * @param addr : server IP address and TCP port
+ **/
+static rsbool tcp_session_to(ApiSocketAddrType addr) {
+  return (TCP_is_connected || phase_stats[PHASE_TCP_CONNECT].running) &&
+         tcp_target.Ip.V4.Addr == addr.Ip.V4.Addr &&
+         tcp_target.Port == addr.Port;
+}
 
-    // Extract gateway
-    inet_ntoa(app_data.static_gateway.Ip.V4.Addr, buffer);
-    sprintf(TmpStr, "Gateway: %s", buffer); PRINTLN(TmpStr);
-    #endif
+/**
+ * @brief Background job which resolves the upload target and starts its
+ * TCP connection after a resume, so that the session is already up when
+ * the host sends commands #2 and #4
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtPreconnect(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+  static ApiSocketAddrType addr;
 
-    AppWifiIpv4Config(TRUE, app_data.static_address.Ip.V4.Addr,
-                            app_data.static_subnet.Ip.V4.Addr,
-                            app_data.static_gateway.Ip.V4.Addr, 0);
-    AppWifiWriteStaticIpToNvs();
+  PT_BEGIN(Pt);
+  while (1) {
+    PT_WAIT_UNTIL(Pt, preconnect_pending && !radio_busy);
+    preconnect_pending = FALSE;
+    if (is_suspended || !Wifi_is_connected())
+      continue;
+
+    radio_busy = TRUE;
+    addr.Domain = ASD_AF_INET;
+    addr.Port = upload_target.port;
+    PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail,
+                                              upload_target.name,
+                                              &addr.Ip.V4.Addr));
+    dns_cache_pin(upload_target.name); // Command #2 will ask for it
+    if (addr.Ip.V4.Addr != 0 && !tcp_session_to(addr)) {
+      LOG_INFO(LOG_PRECONNECT, addr.Ip.V4.Addr, 0);
+      PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail, addr));
+    }
+    radio_busy = FALSE;
   }
-
   PT_END(Pt);
 }
 
 /**
- * @brief Resolves a domain name using the DNS service
+ * @brief Gets the time from the SNTP server, with a single request over
+ * UDP. Half of the round trip is added to the server time.
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
- * @param name : domain name to resolve
- * @param o_response : resolved IP address
  **/
-static PT_THREAD(PtWifi_DNS_resolve(struct pt *Pt, const RosMailType *Mail, rsuint8 *name, rsuint32 *o_response)) {
-  *o_response = 0;
-  
-  PT_BEGIN(Pt);
- 
-  SendApiDnsClientResolveReq(COLA_TASK, 0, strlen((char*)name), name);
-
-  // Wait for response from DNS Client
-  RosTimerStart(APP_DNS_RSP_TIMER, APP_DNS_RESOLVE_RSP_TIMEOUT, &DnsRspTimer);
-
-  PT_WAIT_UNTIL(Pt, (IS_RECEIVED(API_DNS_CLIENT_RESOLVE_CFM) ||
-                     IS_RECEIVED(APP_DNS_RSP_TIMEOUT)) &&
-                     !PtMailHandled);
-  PtMailHandled = TRUE;
-  if (IS_RECEIVED(API_DNS_CLIENT_RESOLVE_CFM)) {
-    RosTimerStop(APP_DNS_RSP_TIMER);
-    if (((ApiDnsClientResolveCfmType *)Mail)->Status == RSS_SUCCESS) {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("DNS success");
-      #endif
-      
-      // Store the resolved IP (a 32-bit unsigned integer)
-      *o_response = (rsuint32)((ApiDnsClientResolveCfmType *)Mail)->IpV4;
+static PT_THREAD(PtSntp_sync(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
+  static ApiSocketAddrType addr;
+  static rsuint32 sent, deadline;
 
-      char buffer[50];
-      inet_ntoa(*o_response, buffer);
+  PT_BEGIN(Pt);
+  sntp_next = UPTIME_MS() + SNTP_RETRY; // Unless it succeeds
+
+  addr.Domain = ASD_AF_INET;
+  addr.Port = SNTP_PORT;
+  addr.Ip.V4.Addr = 0;
+  PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail, sntp_server,
+                                            &addr.Ip.V4.Addr));
+  if (addr.Ip.V4.Addr == 0) {
+    LOG_ERROR(LOG_TIME_FAILED, last_dns_status, 0);
+    PT_EXIT(Pt);
+  }
 
-      #ifdef USE_LUART_TERMINAL
-      sprintf(TmpStr, "DNS response for %s: %s", name, buffer);
-      PRINTLN(TmpStr);
-      #endif
-    }
-    else {
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("DNS Failed!");
-      #endif
-    }
+  PT_WAIT_UNTIL(Pt, !udp_busy);
+  udp_busy = TRUE;
+  SendApiSocketCreateReq(COLA_TASK, ASD_AF_INET, AST_DGRAM, ASP_IPPROTO_UDP);
+  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_SOCKET_CREATE_CFM));
+  if (((ApiSocketCreateCfmType *)Mail)->Status != RSS_SUCCESS) {
+    LOG_ERROR(LOG_TIME_FAILED, ((ApiSocketCreateCfmType *)Mail)->Status, 0);
+    udp_busy = FALSE;
+    PT_EXIT(Pt);
   }
-  else {
-    #ifdef USE_LUART_TERMINAL
-    PRINTLN("No response from DNS client");
-    #endif
+  udp_socket = ((ApiSocketCreateCfmType *)Mail)->Handle;
+
+  // Client request, version 4
+  memset(sntp_packet, 0, sizeof(sntp_packet));
+  sntp_packet[0] = 0x23;
+  SendApiSocketSendToReq(COLA_TASK, udp_socket, sntp_packet,
+                         sizeof(sntp_packet), 0, addr);
+  sent = UPTIME_MS();
+  deadline = sent + SNTP_TIMEOUT;
+  udp_waiting = TRUE;
+  PT_WAIT_UNTIL_TIME(Pt, IS_RECEIVED(API_SOCKET_RECEIVE_FROM_IND) &&
+                         ((ApiSocketReceiveFromIndType *)Mail)->Handle ==
+                         udp_socket, deadline);
+  udp_waiting = FALSE;
+
+  // After a timeout, the mail may be a datagram of another socket
+  if (IS_RECEIVED(API_SOCKET_RECEIVE_FROM_IND) &&
+      ((ApiSocketReceiveFromIndType *)Mail)->Handle == udp_socket) {
+    ApiSocketReceiveFromIndType *ind = (ApiSocketReceiveFromIndType *)Mail;
+    rsuint8 *p = ind->BufferPtr;
+
+    // Server response, with a stratum
+    if (ind->BufferLength >= SNTP_PACKET_LENGTH && (p[0] & 7) == 4 &&
+        p[1] != 0) {
+      rsuint32 seconds = ((rsuint32)p[40] << 24) | ((rsuint32)p[41] << 16) |
+                         ((rsuint32)p[42] << 8) | p[43];
+      rsuint32 ms = (((rsuint32)p[44] << 8) | p[45]) * 1000 >> 16;
+
+      time_rtt = (rsuint16)(UPTIME_MS() - sent);
+      ms += time_rtt / 2;
+      time_base = seconds - SNTP_UNIX_OFFSET + ms / 1000;
+      time_base_ms = ms % 1000;
+      time_base_uptime = UPTIME_MS();
+      time_synced = TRUE;
+      sntp_next = time_base_uptime + sntp_period * 60 * 1000UL;
+      LOG_INFO(LOG_TIME_SYNCED, time_base, time_rtt);
+    }
+    else
+      LOG_ERROR(LOG_TIME_FAILED, RSS_FAILED, 0);
+    SendApiSocketFreeBufferReq(COLA_TASK, udp_socket, ind->BufferPtr);
   }
+  else
+    LOG_ERROR(LOG_TIME_FAILED, RSS_NO_DATA, 0);
 
+  SendApiSocketCloseReq(COLA_TASK, udp_socket);
+  udp_busy = FALSE;
   PT_END(Pt);
 }
 
 /**
- * @brief Event handled. Fired when the TCP connection has been
- * stablished
+ * @brief Background job which syncs the time after connecting and
+ * every sntp_period minutes, if SNTP_AUTO is set, or when the host asks
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
  **/
-static PT_THREAD(PtWifi_TCP_on_connect(struct pt *Pt, const RosMailType *Mail)) {
-  AppSocketDataType *pInst = (AppSocketDataType *)PtInstDataPtr;
-  socketHandle = pInst->SocketHandle;
+static PT_THREAD(PtSntp(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
 
   PT_BEGIN(Pt);
-  #ifdef USE_LUART_TERMINAL
-  PRINTLN("PtWifi_TCP_on_connect FIRED");
-  #endif
-  
-  TCP_is_connected = true;
-                     
-  // Do not exit from the protothread until the TCP socket is closed
-  PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_SOCKET_CLOSE_IND));
-  
+  while (1) {
+    PT_WAIT_UNTIL(Pt, sntp_pending && !radio_busy);
+    sntp_pending = FALSE;
+    if (is_suspended || !Wifi_is_connected())
+      continue;
+
+    radio_busy = TRUE;
+    PT_SPAWN(Pt, &childPt, PtSntp_sync(&childPt, Mail));
+    radio_busy = FALSE;
+  }
   PT_END(Pt);
 }
 
 /**
- * @brief Starts a new TCP connection to the given server
+ * @brief Background job which waits for a better link while a deferred
+ * send is held. If DEFER_AUTO_SUSPEND is set, the radio is suspended
+ * and resumed every defer_probe seconds to sample the RSSI. The send
+ * goes out when the link is good, or at its deadline anyway.
  * @param Pt : current protothread pointer
  * @param Mail : protothread mail
- * @param addr : server IP address and TCP port
  **/
-static PT_THREAD(PtWifi_TCP_start(struct pt *Pt, const RosMailType *Mail, ApiSocketAddrType addr)) {
-  #ifdef USE_LUART_TERMINAL
-  AppSocketDataType *pInst = (AppSocketDataType *)PtInstDataPtr;
-  #endif
+static PT_THREAD(PtDeferral(struct pt *Pt, const RosMailType *Mail)) {
+  static rsuint32 wake_up, deadline;
+  rsuint8 i;
 
   PT_BEGIN(Pt);
-  
-  if (!is_suspended) {
-    TCP_is_connected = false;
-    
-    AppSocketStartTcpClient(&PtList, addr, PtWifi_TCP_on_connect);  
+  while (1) {
+    PT_WAIT_UNTIL(Pt, HOUSEKEEPING_TICK);
+    tx_queue_pump(); // Deadline reached or link sampled good
+    if (!tx_queue_held() || !(defer_flags & DEFER_AUTO_SUSPEND) ||
+        radio_busy || radio_wanted || is_suspended || !Wifi_is_connected())
+      continue;
+
+    // Suspend until the next probe, the deadline or a host command
+    radio_busy = TRUE;
+    is_suspended = true;
+    energy_update();
+    SendApiWifiSuspendReq(COLA_TASK, 10*60*1000); // ms
+    PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SUSPEND_CFM));
+    wake_up = UPTIME_MS() + defer_probe * 1000UL;
+    for (i = 0; i < tx_queue_count; i++) {
+      TxEntryType *entry = &tx_queue[(tx_queue_head + i) % TX_QUEUE_LENGTH];
+      if ((rsint32)(entry->deadline - wake_up) < 0)
+        wake_up = entry->deadline;
+    }
+    PT_WAIT_UNTIL_TIME(Pt, radio_wanted || tx_queue_count == 0, wake_up);
+
+    SendApiWifiResumeReq(COLA_TASK);
+    PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_RESUME_CFM));
+    is_suspended = false;
+    energy_update();
+
+    // Probe the link
+    defer_stats[3]++;
+    SendApiWifiGetRssiReq(COLA_TASK);
+    deadline = UPTIME_MS() + DEFER_RSSI_TIMEOUT;
+    PT_WAIT_UNTIL_TIME(Pt, IS_RECEIVED(API_WIFI_GET_RSSI_CFM), deadline);
+    wifi_rssi_time = UPTIME_MS();
+    radio_busy = FALSE;
+    tx_queue_pump();
+  }
+  PT_END(Pt);
+}
 
-    #ifdef USE_LUART_TERMINAL
-    if (pInst->LastError != RSS_SUCCESS) {
-      sprintf(TmpStr, "AppSocketStartTcpClient ERROR! pInst->LastError == %d", pInst->LastError);
-      PRINTLN(TmpStr);
+/**
+ * @brief Checks if an SPI command uses the WiFi chip, so that it must
+ * wait for the background jobs. It also resumes the chip suspended by
+ * PtDeferral.
+ * @param command : SPI command
+ **/
+static rsbool command_uses_radio(rsuint8 command) {
+  switch (command) {
+    case 2: case 3: case 4: case 5: case 6: case 7:
+    case 10: case 11: case 14: case 15: case 19: case 32: case 39:
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/**
+ * @brief Computes the CRC16-CCITT (polynomial 0x1021, initial value
+ * 0xFFFF) of a buffer
+ * @param crc : CRC of the previous bytes, 0xFFFF at the start
+ * @param data : buffer
+ * @param len : number of bytes
+ **/
+static rsuint16 crc16_ccitt(rsuint16 crc, const rsuint8 *data, rsuint16 len) {
+  int i;
+  while (len-- > 0) {
+    crc ^= (rsuint16)*data++ << 8;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/**
+ * @brief Checks that a frame payload matches the argument layout of
+ * its command (see CommandLayouts)
+ * @param command : SPI command
+ * @param payload : frame payload
+ * @param length : payload length
+ **/
+static rsbool frame_layout_ok(rsuint8 command, const rsuint8 *payload,
+                              rsuint16 length) {
+  const char *layout;
+  rsuint32 pos = 0;
+
+  if (command == 0 || command > FRAME_LAST_COMMAND ||
+      CommandLayouts[command - 1] == NULL)
+    return FALSE;
+  for (layout = CommandLayouts[command - 1]; *layout; layout++) {
+    switch (*layout) {
+      case 's':
+        if (pos + 1 > length)
+          return FALSE;
+        pos += 1 + payload[pos];
+        break;
+      case 'S':
+        if (pos + 2 > length)
+          return FALSE;
+        pos += 2 + (payload[pos] | (payload[pos + 1] << 8));
+        break;
+      default:
+        pos += *layout - '0';
     }
-    #endif
   }
+  return pos == length;
+}
 
-  PT_END(Pt);
+/**
+ * @brief Looks for the cached response of a frame
+ * @param seq : sequence number of the frame
+ * @param crc : CRC of the frame
+ * @return the cached response, or NULL if it is not known
+ **/
+static LinkRecordType *link_lookup(rsuint8 seq, rsuint16 crc) {
+  int i;
+  for (i = 0; i < LINK_CACHE_LENGTH; i++) {
+    if (link_cache[i].seq == seq && link_cache[i].crc == crc)
+      return &link_cache[i];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts caching the response of a sequenced frame, replacing
+ * the oldest cached response
+ * @param seq : sequence number of the frame
+ * @param crc : CRC of the frame
+ * @param command : SPI command
+ **/
+static void link_begin(rsuint8 seq, rsuint16 crc, rsuint8 command) {
+  int i;
+
+  // A sequence number is only kept once
+  for (i = 0; i < LINK_CACHE_LENGTH; i++) {
+    if (link_cache[i].seq == seq)
+      link_cache[i].seq = 0;
+  }
+
+  link_record = &link_cache[link_next];
+  link_next = (link_next + 1) % LINK_CACHE_LENGTH;
+  link_record->seq = seq;
+  link_record->command = command;
+  link_record->crc = crc;
+  link_record->truncated = FALSE;
+  link_record->length = 0;
+}
+
+/**
+ * @brief Appends response bytes to the cached response of the current
+ * command, if it is sequenced (see SPI_WRITE)
+ * @param data : response bytes
+ * @param len : number of bytes
+ **/
+static void link_capture(const rsuint8 *data, rsuint16 len) {
+  if (link_record == NULL)
+    return;
+  if (link_record->length + len > LINK_RESPONSE_LENGTH) {
+    link_record->truncated = TRUE;
+    return;
+  }
+  memcpy(link_record->data + link_record->length, data, len);
+  link_record->length += len;
+}
+
+/**
+ * @brief Takes the next bytes of the frame payload (see SPI_READ)
+ * @param dest : destination buffer
+ * @param len : number of bytes
+ **/
+static void frame_read(rsuint8 *dest, rsuint16 len) {
+  memcpy(dest, frame_buffer + frame_pos, len);
+  frame_pos += len;
 }
 
 /**
@@ -999,24 +4230,238 @@ static PT_THREAD(PtTest(struct pt *Pt, const RosMailType *Mail)) {
   PRINTLN("");
   
 
-  PRINTLN("* Test SPAWN PtWifi_DNS_resolve");
-  const char *name = "www.uoc.edu";
-  rsuint32 response;
-  PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail, (rsuint8*)name, &response));
-  sprintf(TmpStr, "response is %u", (size_t)response);
-  PRINTLN(TmpStr);  
-  PRINTLN("");*/
+  PRINTLN("* Test SPAWN PtWifi_DNS_resolve");
+  const char *name = "www.uoc.edu";
+  rsuint32 response;
+  PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail, (rsuint8*)name, &response));
+  sprintf(TmpStr, "response is %u", (size_t)response);
+  PRINTLN(TmpStr);  
+  PRINTLN("");*/
+
+
+  /*PRINTLN("* Test SPAWN PtWifi_disconnect");
+  PT_SPAWN(Pt, &childPt, PtWifi_disconnect(&childPt, Mail));
+  PRINTLN("");
+  
+  PRINTLN("* Test SPAWN PtWifi_disconnect");
+  PT_SPAWN(Pt, &childPt, PtWifi_disconnect(&childPt, Mail));
+  PRINTLN("");*/
+  #endif
+
+  PT_END(Pt);
+}
+
+#ifdef USE_LUART_TERMINAL
+/**
+ * @brief Prints the statistics of the benchmark iterations
+ * @param samples : duration of the successful iterations, in ms
+ * @param count : number of successful iterations
+ * @param failures : number of failed iterations
+ **/
+static void bench_report(rsuint32 *samples, int count, int failures) {
+  int i, j;
+
+  // Insertion sort, to get the percentiles
+  for (i = 1; i < count; i++) {
+    rsuint32 sample = samples[i];
+    for (j = i; j > 0 && samples[j - 1] > sample; j--)
+      samples[j] = samples[j - 1];
+    samples[j] = sample;
+  }
+
+  if (count == 0)
+    sprintf(TmpStr, "ok=0 failed=%d", failures);
+  else
+    sprintf(TmpStr, "ok=%d failed=%d min=%lu median=%lu p95=%lu max=%lu ms",
+            count, failures, (unsigned long)samples[0],
+            (unsigned long)samples[count / 2],
+            (unsigned long)samples[(count * 95 + 99) / 100 - 1],
+            (unsigned long)samples[count - 1]);
+  PRINTLN(TmpStr);
+}
+
+/**
+ * @brief Runs a connection cycle several times and reports its timing
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param cycle : "conn" (associate, disconnect), "dns" (resolve without
+ * cache), "tcp" (connect, send a request, receive, close) or "susp"
+ * (suspend and resume the WiFi chip)
+ * @param iterations : number of iterations, up to BENCH_MAX_ITERATIONS
+ * @param name : server name for the "dns" and "tcp" cycles
+ **/
+static PT_THREAD(PtBench(struct pt *Pt, const RosMailType *Mail,
+                         const char *cycle, int iterations,
+                         const char *name)) {
+  static struct pt childPt;
+  static rsuint32 samples[BENCH_MAX_ITERATIONS];
+  static int count, failures, i, n;
+  static rsuint32 start, deadline, ip;
+  static rsbool ok;
+  static ApiSocketAddrType addr;
+  static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+
+  PT_BEGIN(Pt);
+  n = iterations < BENCH_MAX_ITERATIONS ? iterations : BENCH_MAX_ITERATIONS;
+  count = failures = 0;
+
+  // Keep the background jobs away from the radio
+  PT_WAIT_UNTIL(Pt, !radio_busy);
+  radio_busy = TRUE;
+
+  for (i = 0; i < n; i++) {
+    start = UPTIME_MS();
+    ok = FALSE;
+
+    if (strcmp(cycle, "conn") == 0) {
+      PT_SPAWN(Pt, &childPt, PtWifi_connect(&childPt, Mail));
+      ok = Wifi_is_connected();
+      PT_SPAWN(Pt, &childPt, PtWifi_disconnect(&childPt, Mail));
+    }
+    else if (strcmp(cycle, "dns") == 0) {
+      memset(dns_cache, 0, sizeof(dns_cache));
+      PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail,
+                                                (rsuint8*)name, &ip));
+      ok = (ip != 0);
+    }
+    else if (strcmp(cycle, "tcp") == 0) {
+      PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail,
+                                                (rsuint8*)name, &ip));
+      if (ip == 0) {
+        // The name is not resolved: there is nothing to connect to
+        failures++;
+        sprintf(TmpStr, "%d: failed, name not resolved", i + 1);
+        PRINTLN(TmpStr);
+        continue;
+      }
+      addr.Domain = ASD_AF_INET;
+      addr.Ip.V4.Addr = ip;
+      addr.Port = 80;
+      start = UPTIME_MS(); // The name is resolved from the cache
+      PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail, addr));
+      deadline = UPTIME_MS() + BENCH_TIMEOUT;
+      PT_WAIT_UNTIL_TIME(Pt, TCP_is_connected, deadline);
+      if (TCP_is_connected &&
+          Wifi_TCP_send((const rsuint8*)request, strlen(request)) != 0) {
+        deadline = UPTIME_MS() + BENCH_TIMEOUT;
+        PT_WAIT_UNTIL_TIME(Pt, rx_pending > 0, deadline);
+        ok = (rx_pending > 0);
+      }
+      rx_queue_flush();
+      if (TCP_is_connected) {
+        Wifi_TCP_close();
+        deadline = UPTIME_MS() + BENCH_TIMEOUT;
+        PT_WAIT_UNTIL_TIME(Pt, !TCP_is_connected, deadline);
+      }
+    }
+    else if (strcmp(cycle, "susp") == 0) {
+      // As PtWifi_suspend and PtWifi_resume, without stopping the
+      // microcontroller in between
+      is_suspended = true;
+      SendApiWifiSuspendReq(COLA_TASK, 10*60*1000); // ms
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_SUSPEND_CFM));
+      SendApiWifiResumeReq(COLA_TASK);
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(API_WIFI_RESUME_CFM));
+      is_suspended = false;
+      ok = TRUE;
+    }
+    else {
+      PRINTLN("cycles: conn, dns, tcp, susp");
+      break;
+    }
+
+    if (ok)
+      samples[count++] = UPTIME_MS() - start;
+    else
+      failures++;
+    sprintf(TmpStr, "%d: %s %lu ms", i + 1, ok ? "ok" : "failed",
+            (unsigned long)(UPTIME_MS() - start));
+    PRINTLN(TmpStr);
+  }
+
+  radio_busy = FALSE;
+  bench_report(samples, count, failures);
+  PT_END(Pt);
+}
+
+/**
+ * @brief Derives the PMK of the IEEE 802.11i test vector several times,
+ * and reports the time of each derivation, yields included
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ * @param iterations : number of derivations, up to BENCH_MAX_ITERATIONS
+ **/
+static PT_THREAD(PtPmkBench(struct pt *Pt, const RosMailType *Mail,
+                            int iterations)) {
+  static const char *expected =
+    "f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e";
+  static struct pt childPt;
+  static rsuint32 samples[BENCH_MAX_ITERATIONS];
+  static ApInfoType test_ap;
+  static int count, failures, i, n;
+  static rsuint32 start, cycles;
+
+  PT_BEGIN(Pt);
+  n = iterations;
+  if (n < 1)
+    n = 1;
+  if (n > BENCH_MAX_ITERATIONS)
+    n = BENCH_MAX_ITERATIONS;
+
+  cycles = 0;
+  count = failures = 0;
+  for (i = 0; i < n; i++) {
+    strcpy((char*)test_ap.Ssid, "IEEE");
+    strcpy((char*)test_ap.Key, "password");
+    test_ap.KeyLength = 8;
+    start = UPTIME_MS();
+    cycles -= DWT->CYCCNT;
+    PT_SPAWN(Pt, &childPt, PtWifi_derive_PMK(&childPt, Mail, &test_ap));
+    cycles += DWT->CYCCNT;
+    if (memcmp(test_ap.Key, expected, 2 * PMK_LENGTH) != 0)
+      failures++; // Wrong PMK
+    else
+      samples[count++] = UPTIME_MS() - start;
+  }
+
+  bench_report(samples, count, failures);
+  sprintf(TmpStr, "%lu cycles per derivation", (unsigned long)(cycles / n));
+  PRINTLN(TmpStr);
+  PT_END(Pt);
+}
+#endif
 
+/**
+ * @brief Boot job. It resets the WiFi chip while PtMain already serves
+ * the SPI and, if the auto-start is enabled and a profile is stored at
+ * the NVS, sets up the AP and the IP config and connects. It holds the
+ * radio lock meanwhile, so the commands which use the radio wait.
+ * @param Pt : current protothread pointer
+ * @param Mail : protothread mail
+ **/
+static PT_THREAD(PtBoot(struct pt *Pt, const RosMailType *Mail)) {
+  static struct pt childPt;
 
-  /*PRINTLN("* Test SPAWN PtWifi_disconnect");
-  PT_SPAWN(Pt, &childPt, PtWifi_disconnect(&childPt, Mail));
-  PRINTLN("");
-  
-  PRINTLN("* Test SPAWN PtWifi_disconnect");
-  PT_SPAWN(Pt, &childPt, PtWifi_disconnect(&childPt, Mail));
-  PRINTLN("");*/
-  #endif
+  PT_BEGIN(Pt);
 
+  // Reset the Atheros WiFi chip
+  AppLedSetLedState(LED_STATE_ACTIVE);
+  PT_SPAWN(Pt, &childPt, PtAppWifiReset(&childPt, Mail));
+  wifi_powered = TRUE; // The reset leaves the chip powered
+  energy_update();
+  SendApiCalibrateLfrcoReq(COLA_TASK, 3600); // Calibrate LFRCO every hour
+  AppLedSetLedState(LED_STATE_IDLE);
+
+  if (app_data.auto_start == AUTO_START_MAGIC && app_data.ap_info.Ssid[0]) {
+    PT_SPAWN(Pt, &childPt, PtWifi_setup_AP(&childPt, Mail, NULL));
+    PT_SPAWN(Pt, &childPt, PtWifi_IP_config(&childPt, Mail, NULL));
+    PT_SPAWN(Pt, &childPt, PtWifi_connect(&childPt, Mail));
+    wifi_wanted = Wifi_is_connected(); // Kept by the supervisor
+    LOG_INFO(LOG_AUTO_START, wifi_wanted, 0);
+  }
+
+  booting = FALSE;
+  radio_busy = FALSE;
   PT_END(Pt);
 }
 
@@ -1030,14 +4475,13 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
   
   PT_BEGIN(Pt);
   
-  // Read the app configuration from NVS
-  Wifi_read_appInfo_from_NVS();
+  // Read the app configuration and the performance counters from NVS
+  nvs_load();
   
-  // Reset the Atheros WiFi chip
-  AppLedSetLedState(LED_STATE_ACTIVE);
-  PT_SPAWN(Pt, &childPt, PtAppWifiReset(&childPt, Mail));
-  SendApiCalibrateLfrcoReq(COLA_TASK, 3600); // Calibrate LFRCO every hour
-  AppLedSetLedState(LED_STATE_IDLE);
+  // Reset the WiFi chip in the background
+  booting = TRUE;
+  radio_busy = TRUE;
+  PtStart(&PtList, PtBoot, NULL, NULL);
 
   // Use LEUART1 for debug messages
   #ifdef USE_LUART_TERMINAL
@@ -1045,6 +4489,7 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
   #endif
 
   #ifdef USE_LUART_TERMINAL
+  PT_WAIT_UNTIL(Pt, !booting);
   PRINTLN(""); PRINTLN("Ready"); PRINTLN("");
   #endif
 
@@ -1135,6 +4580,34 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
         AppSocketDataType *pInst = (AppSocketDataType *)PtInstDataPtr;
         sprintf(TmpStr, "pInst->LastError: %d", pInst->LastError); PRINTLN(TmpStr);
       }
+      else if (strcmp(argv[0], "prof") == 0) {
+        static const char *phase_names[PHASE_COUNT] =
+          {"scan", "associate", "dhcp", "dns", "tcp"};
+        int i;
+        for (i = 0; i < PHASE_COUNT; i++) {
+          PhaseStatsType *stats = &phase_stats[i];
+          sprintf(TmpStr, "%s: n=%u last=%lu min=%lu avg=%lu max=%lu ms",
+                  phase_names[i], stats->count, (unsigned long)stats->last,
+                  (unsigned long)stats->min,
+                  (unsigned long)(stats->count ? stats->total / stats->count : 0),
+                  (unsigned long)stats->max);
+          PRINTLN(TmpStr);
+        }
+      }
+      else if (strcmp(argv[0], "bench") == 0) {
+        // bench <cycle> <iterations> [name]
+        if (argc < 3)
+          PRINTLN("usage: bench conn|dns|tcp|susp <n> [name]");
+        else
+          PT_SPAWN(Pt, &childPt,
+                   PtBench(&childPt, Mail, argv[1], atoi(argv[2]),
+                           argc > 3 ? argv[3] : "www.example.com"));
+      }
+      else if (strcmp(argv[0], "pmkbench") == 0) {
+        // pmkbench [iterations]
+        PT_SPAWN(Pt, &childPt,
+                 PtPmkBench(&childPt, Mail, argc > 1 ? atoi(argv[1]) : 1));
+      }
       else if (strcmp(argv[0], "tcpclose") == 0) {
         Wifi_TCP_close();
       }
@@ -1143,13 +4616,13 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
       }
       else if (strcmp(argv[0], "send") == 0) {
         PRINTLN("Send...");  
-        strcpy((char*)tx_buffer, "GET / HTTP/1.0\n\n");
-        size_t bytes_to_send = strlen((char*)tx_buffer);
+        const char *request = "GET / HTTP/1.0\n\n";
+        size_t bytes_to_send = strlen(request);
 
-        sprintf(TmpStr, "Sending %s (%d bytes)", (char*)tx_buffer, strlen((char*)tx_buffer));
+        sprintf(TmpStr, "Sending %s (%d bytes)", request, bytes_to_send);
         PRINTLN(TmpStr);        
         
-        Wifi_TCP_send(bytes_to_send);
+        Wifi_TCP_send((const rsuint8*)request, bytes_to_send);
       }
       else if (strcmp(argv[0], "receive") == 0) {
         Wifi_TCP_receive();
@@ -1181,83 +4654,164 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
   DrvSpiInit(baud_rate);
   
   while (1) {
+    // In framed mode, the buffer of the payload is taken first, so that
+    // its transfer can be armed as soon as the header is received
+    if (framed_mode)
+      PT_WAIT_BLOCK(Pt, frame_buffer);
+
     // Wait until SPI data is received
+    spi_waiting_command = TRUE;
     PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+    spi_waiting_command = FALSE;
     
     // Read SPI command
-    rsuint8 command;
-    DrvSpiRx(&command, sizeof(command));
-    PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+    static rsuint8 command;
+    if (framed_mode) {
+      // Frame header, and then the payload with its CRC
+      static rsuint8 frame_header[FRAME_HEADER_LENGTH];
+      static rsuint8 frame_status;
+      static rsuint16 frame_crc;
+      DrvSpiRx(frame_header, sizeof(frame_header));
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+      command = frame_header[0];
+      frame_length = frame_header[2] | (frame_header[3] << 8);
+      frame_pos = 0;
+
+      if (frame_length > FRAME_MAX_PAYLOAD) {
+        // Drain the payload, one block at a time
+        static rsuint32 remaining;
+        remaining = (rsuint32)frame_length + FRAME_CRC_LENGTH;
+        while (remaining > 0) {
+          rsuint16 len = remaining > POOL_BLOCK_SIZE ? POOL_BLOCK_SIZE
+                                                     : remaining;
+          DrvSpiRx(frame_buffer, len);
+          remaining -= len;
+          PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        }
+        frame_status = FRAME_TOO_LONG;
+      }
+      else {
+        DrvSpiRx(frame_buffer, frame_length + FRAME_CRC_LENGTH);
+        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+
+        frame_crc = crc16_ccitt(0xFFFF, frame_header, sizeof(frame_header));
+        frame_crc = crc16_ccitt(frame_crc, frame_buffer, frame_length);
+        if (frame_crc != (frame_buffer[frame_length] |
+                          (frame_buffer[frame_length + 1] << 8)))
+          frame_status = FRAME_BAD_CRC;
+        else if (!frame_layout_ok(command, frame_buffer, frame_length))
+          frame_status = FRAME_BAD_LAYOUT;
+        else
+          frame_status = FRAME_OK;
+      }
+
+      // Retry of a sequenced frame already executed
+      static LinkRecordType *link_retry;
+      link_retry = NULL;
+      if (frame_status == FRAME_OK && frame_header[1] != 0) {
+        link_retry = link_lookup(frame_header[1], frame_crc);
+        if (link_retry != NULL && link_retry->truncated)
+          frame_status = FRAME_DUPLICATE;
+      }
+
+      // The status precedes the response of the command, if any. Rejected
+      // frames are not executed.
+      DrvSpiTxStart(&frame_status, sizeof(frame_status));
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_TX_DONE));
+      if (frame_status == FRAME_OK && link_retry != NULL &&
+          link_retry->length > 0) {
+        DrvSpiTxStart(link_retry->data, link_retry->length);
+        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_TX_DONE));
+      }
+      if (frame_status != FRAME_OK || link_retry != NULL) {
+        pool_free(frame_buffer);
+        frame_buffer = NULL;
+        continue;
+      }
+      if (frame_header[1] != 0 && command != 37)
+        link_begin(frame_header[1], frame_crc, command);
+    }
+    else {
+      DrvSpiRx(&command, sizeof(command));
+      PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+    }
+
+    // Buffer for the payload and response of the command. Unlike local
+    // variables, it is kept across PT_WAIT_UNTIL.
+    static rsuint8 *cmd_buffer;
+    PT_WAIT_BLOCK(Pt, cmd_buffer);
+
+    // Wait for the boot and the background jobs using the WiFi chip
+    static rsbool radio_locked;
+    radio_locked = command_uses_radio(command);
+    if (radio_locked) {
+      radio_wanted = TRUE;
+      PT_WAIT_UNTIL(Pt, !booting && !radio_busy);
+      radio_wanted = FALSE;
+      radio_busy = TRUE;
+    }
     
     switch (command) {
       case 1: { // get status
         rsuint8 status = Wifi_get_status();
-        DrvSpiTxStart(&status, 1);
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_TX_DONE));
+        SPI_WRITE(Pt, &status, 1);
         break;
       }
       case 2: { // DNS resolve
         // Read name to resolve (ex: "www.example.com")
 
         // First read the size of the name
-        rsuint8 name_size;
-        DrvSpiRx(&name_size, sizeof(name_size));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint8 name_size;
+        SPI_READ(Pt, &name_size, sizeof(name_size));
         
         // Second, read the name
-        rsuint8 name[100];
-        DrvSpiRx((rsuint8*)&name, name_size);
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
-        name[name_size] = 0; // put trailing zero
+        SPI_READ(Pt, cmd_buffer, name_size);
+        cmd_buffer[name_size] = 0; // put trailing zero
 
         // Resolve
-        rsuint32 response;
-        PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail, name, &response));
+        static rsuint32 response;
+        PT_SPAWN(Pt, &childPt, PtWifi_DNS_resolve(&childPt, Mail, cmd_buffer, &response));
         
         // Send response
-        DrvSpiTxStart((rsuint8*)&response, sizeof(response));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_TX_DONE));
+        SPI_WRITE(Pt, (rsuint8*)&response, sizeof(response));
         break;
       }
       case 3: { // IP config
         // First read the size of the config
-        rsuint8 config_size;
-        DrvSpiRx(&config_size, sizeof(config_size));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint8 config_size;
+        SPI_READ(Pt, &config_size, sizeof(config_size));
 
         // Second, read the config
-        rsuint8 config[100];
         if (config_size > 0) {
-          DrvSpiRx((rsuint8*)&config, config_size);
-          PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+          SPI_READ(Pt, cmd_buffer, config_size);
         }
 
         // Do IP config        
         PT_SPAWN(Pt, &childPt, PtWifi_IP_config(&childPt, Mail,
-                                      config_size > 0 ? config : NULL));
+                                      config_size > 0 ? cmd_buffer : NULL));
         break;
       }
       case 4: { // TCP start
         // Given the IP address of the server (rsuint32), start the connection.
         // The upper layer must poll in order to check when the connection
         // has been stablished.
-        ApiSocketAddrType addr;
+        static ApiSocketAddrType addr;
         addr.Domain = ASD_AF_INET;
 
         // Read the IP of the TCP server (rsuint32)
-        DrvSpiRx((rsuint8*)&addr.Ip.V4.Addr, sizeof(addr.Ip.V4.Addr));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        SPI_READ(Pt, (rsuint8*)&addr.Ip.V4.Addr, sizeof(addr.Ip.V4.Addr));
 
         // Read the port of the TCP server
-        DrvSpiRx((rsuint8*)&addr.Port, sizeof(addr.Port));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        SPI_READ(Pt, (rsuint8*)&addr.Port, sizeof(addr.Port));
 
-        // Start TCP connection
-        PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail, addr));
+        // Start TCP connection, unless it was pre-connected on resume
+        if (!tcp_session_to(addr))
+          PT_SPAWN(Pt, &childPt, PtWifi_TCP_start(&childPt, Mail, addr));
         break;
       }
       case 5: { // Associate & connect to the WiFi AP
         PT_SPAWN(Pt, &childPt, PtWifi_connect(&childPt, Mail));
+        wifi_wanted = Wifi_is_connected(); // Kept by the supervisor
         break;
       }
       case 6: { // WiFi AP deassociate & disconnect
@@ -1266,19 +4820,17 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
       }
       case 7: { // setup AP
         // Read ap_data size
-        rsuint8 ap_data_size;
-        DrvSpiRx(&ap_data_size, sizeof(ap_data_size));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint8 ap_data_size;
+        SPI_READ(Pt, &ap_data_size, sizeof(ap_data_size));
         
         // Read ap_data
-        rsuint8 ap_data[100];
         if (ap_data_size > 0) {
-          DrvSpiRx((rsuint8*)&ap_data, ap_data_size);
-          PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+          SPI_READ(Pt, cmd_buffer, ap_data_size);
+          cmd_buffer[ap_data_size] = 0; // put trailing zero
         }        
         
         PT_SPAWN(Pt, &childPt, PtWifi_setup_AP(&childPt, Mail,
-                                  ap_data_size > 0 ? ap_data : NULL));
+                                  ap_data_size > 0 ? cmd_buffer : NULL));
         break;
       }
       case 8: { // TCP socket close
@@ -1286,34 +4838,49 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
         break;
       }
       case 9: { // TCP receive
-        // The TCP data is already in rx_buffer
+        // Move as much received data as possible to the buffer
         // Number of bytes: TCP_Rx_bufferLength
-        DrvSpiTxStart(rx_buffer, TCP_Rx_bufferLength);
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_TX_DONE));         
+        TCP_Rx_bufferLength = rx_queue_read(cmd_buffer, TX_BUFFER_LENGTH);
+        SPI_WRITE(Pt, cmd_buffer, TCP_Rx_bufferLength);         
         break;
       }
       case 10: { // TCP send
         // Read the number of bytes to send (rsuint16)
-        rsuint16 len;
-        DrvSpiRx((rsuint8*)&len, sizeof(len));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint16 len;
+        SPI_READ(Pt, (rsuint8*)&len, sizeof(len));
         
         if (len > TX_BUFFER_LENGTH)
           len = TX_BUFFER_LENGTH;
+
+        // Wait for a free entry in the TX queue. The send is rejected,
+        // as in command #19, if the WiFi is suspended, the session is
+        // closed meanwhile or the queue is full of held deferred sends:
+        // then the data is read and dropped.
+        static TxEntryType *entry;
+        entry = is_suspended ? NULL : tx_queue_alloc();
+        PT_WAIT_UNTIL(Pt, entry != NULL || is_suspended || !TCP_is_connected ||
+                          (tx_queue_count == TX_QUEUE_LENGTH &&
+                           tx_queue_held()) ||
+                          (tx_queue_free() > 0 &&
+                           (entry = tx_queue_alloc()) != NULL));
           
-        // Read data to send into tx_buffer
-        DrvSpiRx(tx_buffer, len);
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        // Read data to send into the TX queue
+        SPI_READ(Pt, entry != NULL ? entry->data : cmd_buffer, len);
         
         // Send data using the TCP socket
-        SendApiSocketSendReq(COLA_TASK, socketHandle, tx_buffer, len, 0);
+        if (entry != NULL && !is_suspended)
+          tx_queue_commit(entry, encode_frame(entry, len));
+        else {
+          if (entry != NULL)
+            tx_queue_cancel(entry);
+          last_send_status = (rsuint8)RSS_FAILED;
+        }
         break;
       }
       case 11: { // Wifi chip power on/off        
-        // Read parameter (0=off, 1=on)
-        rsuint8 param;
-        DrvSpiRx(&param, sizeof(param));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        // Read parameter (0=off, 1=on, 2=off keeping the warm state)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
         
         PT_SPAWN(Pt, &childPt, PtWifi_power_on_off(&childPt, Mail,
                                                    param));        
@@ -1322,9 +4889,8 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
       case 12: { // Wifi set powersave profile      
         // Read parameter
         // 0: low power, 1: medium power, 2: high power, 3: max power
-        rsuint8 param;
-        DrvSpiRx(&param, sizeof(param));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
         
         // Set powersave profile
         Wifi_set_power_save_profile(param);
@@ -1332,9 +4898,8 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
       }
       case 13: { // Wifi set transmit power        
         // Read parameter
-        rsuint8 param;
-        DrvSpiRx(&param, sizeof(param));
-        PT_WAIT_UNTIL(Pt, IS_RECEIVED(SPI_RX_DATA));
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
         
         // Set transmit power
         Wifi_set_tx_power(param);
@@ -1348,8 +4913,509 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
         PT_SPAWN(Pt, &childPt, PtWifi_resume(&childPt, Mail));
         break;
       }
+      case 16: { // Connection phase profiler
+        // Read parameter (bit 0: reset the statistics after reading)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        rsuint16 len = phase_stats_serialize(cmd_buffer);
+        if (param & 1)
+          phase_stats_reset();
+        SPI_WRITE(Pt, cmd_buffer, len);
+        break;
+      }
+      case 17: { // DHCP lease cache policy
+        // Read the policy (rsuint8) and the lease lifetime in seconds
+        // (rsuint32, 0 for the default)
+        static rsuint8 policy;
+        SPI_READ(Pt, &policy, sizeof(policy));
+
+        static rsuint32 lifetime;
+        SPI_READ(Pt, (rsuint8*)&lifetime, sizeof(lifetime));
+
+        app_data.lease_policy = policy;
+        app_data.lease_lifetime = lifetime;
+        if (policy == LEASE_CACHE_OFF)
+          app_data.lease.valid = 0;
+        Wifi_save_appInfo_to_NVS();
+        break;
+      }
+      case 18: { // TCP paged receive
+        // Read the maximum number of bytes to return (rsuint16)
+        static rsuint16 max_len;
+        SPI_READ(Pt, (rsuint8*)&max_len, sizeof(max_len));
+
+        if (max_len > TX_BUFFER_LENGTH - RX_READ_HEADER_LENGTH)
+          max_len = TX_BUFFER_LENGTH - RX_READ_HEADER_LENGTH;
+
+        // Reply with the number of bytes, the remaining ones (bit 15 set
+        // if received data was lost) and the data
+        rsuint16 len = rx_queue_read(cmd_buffer + RX_READ_HEADER_LENGTH,
+                                     max_len);
+        rsuint8 *p = put_u16(cmd_buffer, len);
+        put_u16(p, rx_pending | (rx_overflow ? RX_OVERFLOW_BIT : 0));
+        SPI_WRITE(Pt, cmd_buffer, RX_READ_HEADER_LENGTH + len);
+        break;
+      }
+      case 19: { // TCP queued send
+        // Read the number of bytes to send (rsuint16)
+        static rsuint16 len;
+        SPI_READ(Pt, (rsuint8*)&len, sizeof(len));
+
+        if (len > TX_BUFFER_LENGTH)
+          len = TX_BUFFER_LENGTH;
+
+        // Read data into the TX queue. If it is full, the data is
+        // read into the command buffer and dropped.
+        static TxEntryType *entry;
+        entry = tx_queue_alloc();
+        SPI_READ(Pt, entry != NULL ? entry->data : cmd_buffer, len);
+
+        // Reply with the sequence number, 0 if rejected
+        if (entry != NULL && !is_suspended) {
+          time_stamp(entry->data, len);
+          cmd_buffer[0] = tx_queue_commit(entry,
+                                          encode_frame(entry, len));
+        }
+        else {
+          if (entry != NULL)
+            tx_queue_cancel(entry);
+          cmd_buffer[0] = 0;
+        }
+        SPI_WRITE(Pt, cmd_buffer, 1);
+        break;
+      }
+      case 20: { // TX queue status
+        rsuint8 free_slots = tx_queue_free();
+        rsuint8 *p = cmd_buffer;
+        *p++ = free_slots;
+        *p++ = tx_done_seq;
+        *p++ = tx_failed_seq;
+        p = put_u16(p, tx_failures);
+        p = put_u16(p, free_slots * TX_BUFFER_LENGTH);
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 21: { // Buffer pool statistics
+        rsuint8 *p = cmd_buffer;
+        *p++ = POOL_BLOCK_COUNT;
+        p = put_u16(p, POOL_BLOCK_SIZE);
+        *p++ = pool_in_use;
+        *p++ = pool_high_water;
+        p = put_u16(p, pool_failures);
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 22: { // Scan cache configuration
+        // Read the freshness window and the background scan interval
+        // (rsuint16 each, seconds)
+        static rsuint16 scan_config[2];
+        SPI_READ(Pt, (rsuint8*)scan_config, sizeof(scan_config));
+
+        scan_cache_window = scan_config[0];
+        scan_background_interval = scan_config[1];
+        break;
+      }
+      case 23: { // Link supervisor configuration
+        // Read the flags (rsuint8, bit 0: enable, bit 1: supervise the
+        // TCP session too) and the maximum backoff between reconnection
+        // attempts (rsuint16, seconds, 0 for the default)
+        static rsuint8 enable;
+        SPI_READ(Pt, &enable, sizeof(enable));
+
+        static rsuint16 max_backoff;
+        SPI_READ(Pt, (rsuint8*)&max_backoff, sizeof(max_backoff));
+
+        supervisor_enabled = (enable & 1) != 0;
+        supervisor_tcp = (enable & 2) != 0;
+        supervisor_max_backoff = max_backoff ? max_backoff
+                                             : SUPERVISOR_DEFAULT_MAX_BACKOFF;
+        if (supervisor_max_backoff < SUPERVISOR_MIN_BACKOFF)
+          supervisor_max_backoff = SUPERVISOR_MIN_BACKOFF;
+        break;
+      }
+      case 24: { // Link supervisor statistics
+        rsuint8 *p = cmd_buffer;
+        *p++ = in_outage;
+        p = put_u16(p, outage_stats.count);
+        p = put_u16(p, outage_stats.attempts);
+        p = put_u32(p, outage_stats.last);
+        p = put_u32(p, outage_stats.max);
+        p = put_u32(p, outage_stats.total);
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 25: { // Extended status
+        rsuint16 len = Wifi_get_extended_status(cmd_buffer);
+        SPI_WRITE(Pt, cmd_buffer, len);
+        break;
+      }
+      case 26: { // Read the log
+        rsuint16 len = log_serialize(cmd_buffer, POOL_BLOCK_SIZE);
+        SPI_WRITE(Pt, cmd_buffer, len);
+        break;
+      }
+      case 27: { // Energy statistics
+        // Read parameter (bit 0: reset the statistics after reading)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        rsuint16 len = energy_serialize(cmd_buffer);
+        if (param & 1)
+          energy_reset();
+        SPI_WRITE(Pt, cmd_buffer, len);
+        break;
+      }
+      case 28: { // Energy model configuration
+        // Read the battery capacity in mAh (rsuint16) and the current of
+        // each state in uA (ENERGY_STATE_COUNT x rsuint32)
+        static rsuint16 battery;
+        SPI_READ(Pt, (rsuint8*)&battery, sizeof(battery));
+
+        energy_update(); // Charge the past at the old currents
+        SPI_READ(Pt, (rsuint8*)energy_current, sizeof(energy_current));
+        energy_battery = battery;
+        break;
+      }
+      case 29: { // Idle mode
+        // Read the mode (rsuint8): 0 off, 1 EM1, 2 EM2
+        static rsuint8 mode;
+        SPI_READ(Pt, &mode, sizeof(mode));
+
+        if (mode <= IDLE_EM2)
+          idle_mode = mode;
+        break;
+      }
+      case 30: { // Idle residency statistics
+        // Read parameter (bit 0: reset the statistics after reading)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        rsuint8 *p = cmd_buffer;
+        p = put_u32(p, idle_entries[0]);
+        p = put_u32(p, idle_time[0]);
+        p = put_u32(p, idle_entries[1]);
+        p = put_u32(p, idle_time[1]);
+        p = put_u32(p, UPTIME_MS());
+        if (param & 1) {
+          idle_entries[0] = idle_entries[1] = 0;
+          idle_time[0] = idle_time[1] = 0;
+        }
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 31: { // Upload target
+        // Read the flags (rsuint8, bit 0: pre-connect on resume), the TCP
+        // port as given to command #4 (rsuint16), the size of the server
+        // name (rsuint8) and the name
+        static rsuint8 target_header[4];
+        SPI_READ(Pt, target_header, sizeof(target_header));
+
+        if (target_header[3] > 0)
+          SPI_READ(Pt, cmd_buffer, target_header[3]);
+
+        if (target_header[3] >= DNS_NAME_LENGTH) {
+          upload_target.preconnect = FALSE; // Name too long
+          break;
+        }
+        memcpy(upload_target.name, cmd_buffer, target_header[3]);
+        upload_target.name[target_header[3]] = 0;
+        upload_target.preconnect = target_header[0] & 1;
+        memcpy(&upload_target.port, &target_header[1],
+               sizeof(upload_target.port));
+        break;
+      }
+      case 32: { // Conditional HTTP GET
+        // Read the size of the host name (rsuint8) and the name, and then
+        // the size of the path (rsuint8) and the path
+        static rsuint8 host_size, path_size;
+        static rsuint8 *body;
+        static HttpResultType http_result;
+        SPI_READ(Pt, &host_size, sizeof(host_size));
+        if (host_size > 0)
+          SPI_READ(Pt, cmd_buffer, host_size);
+        cmd_buffer[host_size] = 0;
+
+        SPI_READ(Pt, &path_size, sizeof(path_size));
+        if (path_size > 0)
+          SPI_READ(Pt, cmd_buffer + host_size + 1, path_size);
+        cmd_buffer[host_size + 1 + path_size] = 0;
+
+        if (host_size + path_size > HTTP_REQUEST_MAX_NAMES) {
+          memset(&http_result, 0, sizeof(http_result));
+          http_result.result = HTTP_RESULT_FAILED;
+        }
+        else {
+          PT_WAIT_BLOCK(Pt, body);
+          PT_SPAWN(Pt, &childPt,
+                   PtHttp_get(&childPt, Mail, (char*)cmd_buffer,
+                              (char*)cmd_buffer + host_size + 1, body,
+                              &http_result));
+          pool_free(body);
+        }
+
+        // Send [result, status (rsuint16), length (rsuint16), hash]
+        rsuint8 *p = cmd_buffer;
+        *p++ = http_result.result;
+        p = put_u16(p, http_result.status);
+        p = put_u16(p, http_result.length);
+        p = put_u32(p, http_result.hash);
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 33: { // Read the cached HTTP document
+        http_cache_load();
+        rsuint16 len = http_cache.valid ? http_cache.length : 0;
+        put_u16(cmd_buffer, len);
+        NvsRead(HTTP_CACHE_NVS_OFFSET + sizeof(http_cache), len,
+                cmd_buffer + 2);
+        SPI_WRITE(Pt, cmd_buffer, len + 2);
+        break;
+      }
+      case 34: { // Frame encoding
+        // Read the mode (rsuint8): bit 0 delta, bit 1 LZSS
+        static rsuint8 mode;
+        SPI_READ(Pt, &mode, sizeof(mode));
+
+        encode_mode = mode & (ENCODE_DELTA | ENCODE_LZ);
+        encode_prev_length = 0;
+        encode_base_lost = FALSE;
+        break;
+      }
+      case 35: { // Frame encoding statistics
+        // Read parameter (bit 0: reset the statistics after reading)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        rsuint8 *p = cmd_buffer;
+        p = put_u32(p, encode_frames);
+        p = put_u32(p, encode_bytes_in);
+        p = put_u32(p, encode_bytes_out);
+        p = put_u32(p, encode_bytes_in ? encode_cycles / encode_bytes_in : 0);
+        if (param & 1) {
+          encode_frames = encode_bytes_in = encode_bytes_out = 0;
+          encode_cycles = 0;
+        }
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 36: { // Framed protocol
+        // Read the mode (rsuint8): 1 framed, 0 one transfer per field.
+        // It applies from the next command.
+        static rsuint8 mode;
+        SPI_READ(Pt, &mode, sizeof(mode));
+
+        framed_mode = (mode == 1);
+        break;
+      }
+      case 37: { // Resend a response
+        // Read the sequence number (rsuint8). 0 clears the cache.
+        static rsuint8 seq;
+        SPI_READ(Pt, &seq, sizeof(seq));
+
+        int i;
+        LinkRecordType *record = NULL;
+        for (i = 0; i < LINK_CACHE_LENGTH; i++) {
+          if (seq == 0)
+            link_cache[i].seq = 0;
+          else if (link_cache[i].seq == seq)
+            record = &link_cache[i];
+        }
+
+        // Reply [status][command][length][response]. Status 0: found,
+        // 1: response too long to be cached, 2: unknown
+        cmd_buffer[0] = record == NULL ? 2 : record->truncated ? 1 : 0;
+        cmd_buffer[1] = record != NULL ? record->command : 0;
+        cmd_buffer[2] = (record != NULL && !record->truncated) ?
+                        record->length : 0;
+        if (cmd_buffer[2] > 0)
+          memcpy(cmd_buffer + 3, record->data, cmd_buffer[2]);
+        SPI_WRITE(Pt, cmd_buffer, 3 + cmd_buffer[2]);
+        break;
+      }
+      #ifdef FAULT_INJECTION
+      case 38: { // Fault injection
+        // Read the configuration (see FaultConfigType)
+        SPI_READ(Pt, &fault_config.dns_fail, 1);
+        SPI_READ(Pt, &fault_config.send_drop, 1);
+        SPI_READ(Pt, cmd_buffer, 10);
+        memcpy(&fault_config.dns_delay, cmd_buffer, 2);
+        memcpy(&fault_config.assoc_delay, cmd_buffer + 2, 2);
+        memcpy(&fault_config.tcp_delay, cmd_buffer + 4, 2);
+        memcpy(&fault_config.disconnect, cmd_buffer + 6, 2);
+        memcpy(&fault_config.seed, cmd_buffer + 8, 2);
+        fault_random = fault_config.seed;
+        fault_last_disconnect = UPTIME_MS();
+
+        // Reply with the faults injected so far, and restart counting
+        rsuint8 *p = cmd_buffer;
+        p = put_u16(p, fault_count[0]);
+        p = put_u16(p, fault_count[1]);
+        p = put_u16(p, fault_count[2]);
+        fault_count[0] = fault_count[1] = fault_count[2] = 0;
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      #endif
+      case 39: { // TCP deferred send
+        // Read the deadline in seconds (rsuint16) and the number of bytes
+        // to send (rsuint16)
+        static rsuint16 defer_args[2];
+        SPI_READ(Pt, defer_args, sizeof(defer_args));
+
+        static rsuint16 len;
+        len = defer_args[1] < TX_BUFFER_LENGTH ? defer_args[1]
+                                               : TX_BUFFER_LENGTH;
+
+        // As command #19, but the send waits for a good link
+        static TxEntryType *entry;
+        entry = tx_queue_alloc();
+        SPI_READ(Pt, entry != NULL ? entry->data : cmd_buffer, len);
+
+        if (entry != NULL && !is_suspended) {
+          entry->deferred = TRUE;
+          entry->deadline = UPTIME_MS() + defer_args[0] * 1000UL;
+          defer_stats[0]++;
+          time_stamp(entry->data, len);
+          cmd_buffer[0] = tx_queue_commit(entry,
+                                          encode_frame(entry, len));
+        }
+        else {
+          if (entry != NULL)
+            tx_queue_cancel(entry);
+          cmd_buffer[0] = 0;
+        }
+        SPI_WRITE(Pt, cmd_buffer, 1);
+        break;
+      }
+      case 40: { // Deferred send configuration
+        // Read the minimum RSSI in dBm (signed byte), the minimum number
+        // of successful sends out of the last 8 (rsuint8), the probe
+        // interval in seconds (rsuint16) and the flags (rsuint8)
+        static rsuint8 defer_config[5];
+        SPI_READ(Pt, defer_config, sizeof(defer_config));
+
+        defer_rssi = (rsint8)defer_config[0];
+        defer_successes = defer_config[1];
+        defer_probe = defer_config[2] | (defer_config[3] << 8);
+        defer_flags = defer_config[4];
+
+        // Reply with the statistics, and restart counting
+        rsuint8 *p = cmd_buffer;
+        int i;
+        for (i = 0; i < 4; i++) {
+          p = put_u16(p, defer_stats[i]);
+          defer_stats[i] = 0;
+        }
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 41: { // Performance counters
+        // Read parameter (bit 0: reset the counters after reading)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        rsuint16 len = perf_serialize(cmd_buffer);
+        if (param & 1) {
+          memset(&perf, 0, sizeof(perf));
+          perf.valid = PERF_MAGIC;
+          perf_dirty = TRUE;
+          perf_flush();
+        }
+        SPI_WRITE(Pt, cmd_buffer, len);
+        break;
+      }
+      case 42: { // Time
+        rsuint16 ms;
+        rsuint32 now = time_now(&ms);
+        rsuint8 *p = cmd_buffer;
+
+        // Reply with the sync flag, the Unix time in s and ms, the seconds
+        // since the last sync and its round trip in ms
+        *p++ = time_synced;
+        p = put_u32(p, now);
+        p = put_u16(p, ms);
+        p = put_u32(p, time_synced ? (UPTIME_MS() - time_base_uptime) / 1000
+                                   : 0);
+        p = put_u16(p, time_rtt);
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+      case 43: { // SNTP configuration
+        // Read the flags (rsuint8, bit 0: sync automatically, bit 1: sync
+        // now), the minutes between syncs (rsuint16), the size of the
+        // server name (rsuint8, 0 to keep the current one) and the name
+        static rsuint8 sntp_header[4];
+        SPI_READ(Pt, sntp_header, sizeof(sntp_header));
+
+        if (sntp_header[3] > 0)
+          SPI_READ(Pt, cmd_buffer, sntp_header[3]);
+
+        if (sntp_header[3] >= DNS_NAME_LENGTH)
+          break; // Name too long
+        if (sntp_header[3] > 0) {
+          memcpy(sntp_server, cmd_buffer, sntp_header[3]);
+          sntp_server[sntp_header[3]] = 0;
+        }
+        sntp_flags = sntp_header[0] & SNTP_AUTO;
+        memcpy(&sntp_period, &sntp_header[1], sizeof(sntp_period));
+        if (sntp_period == 0)
+          sntp_period = SNTP_DEFAULT_PERIOD;
+        if (time_synced)
+          sntp_next = time_base_uptime + sntp_period * 60 * 1000UL;
+        if (sntp_header[0] & SNTP_SYNC_NOW)
+          sntp_pending = TRUE;
+        break;
+      }
+      case 44: { // Auto-start
+        // Read parameter (rsuint8, 1: connect to the stored AP at boot)
+        static rsuint8 param;
+        SPI_READ(Pt, &param, sizeof(param));
+
+        app_data.auto_start = param ? AUTO_START_MAGIC : 0;
+        Wifi_save_appInfo_to_NVS();
+        break;
+      }
+      case 45: { // DNS resolvers
+        // Read the IP of the primary and secondary resolvers (rsuint32
+        // each, 0 for none)
+        static rsuint32 servers[DNS_MAX_SERVERS];
+        SPI_READ(Pt, (rsuint8*)servers, sizeof(servers));
+
+        // The statistics of a replaced resolver start again
+        int i;
+        for (i = 0; i < DNS_MAX_SERVERS; i++) {
+          if (servers[i] == 0 || servers[i] != app_data.dns_servers[i] ||
+              app_data.dns_config != DNS_CONFIG_MAGIC) {
+            dns_rtt[i] = DNS_INITIAL_RTT;
+            dns_wins[i] = 0;
+          }
+        }
+        memcpy(app_data.dns_servers, servers, sizeof(servers));
+        app_data.dns_config = DNS_CONFIG_MAGIC;
+        Wifi_save_appInfo_to_NVS();
+
+        // Reply with the smoothed round trip in ms and the number of first
+        // answers of each resolver
+        rsuint8 *p = cmd_buffer;
+        for (i = 0; i < DNS_MAX_SERVERS; i++) {
+          p = put_u16(p, dns_rtt[i]);
+          p = put_u16(p, dns_wins[i]);
+        }
+        SPI_WRITE(Pt, cmd_buffer, p - cmd_buffer);
+        break;
+      }
+
+    }
 
+    pool_free(cmd_buffer);
+    link_record = NULL;
+    if (frame_buffer != NULL) {
+      pool_free(frame_buffer);
+      frame_buffer = NULL;
     }
+    if (radio_locked)
+      radio_busy = FALSE;
 
   }
   #endif
@@ -1357,6 +5423,108 @@ static PT_THREAD(PtMain(struct pt *Pt, const RosMailType *Mail)) {
   PT_END(Pt);
 }
 
+/**
+ * @brief Checks if a background job needs the periodic housekeeping tick
+ **/
+static rsbool housekeeping_needed(void) {
+  if (is_suspended)
+    return FALSE;
+
+  #ifdef USE_LUART_TERMINAL
+  if (log_count > 0)
+    return TRUE;
+  #endif
+
+  return (scan_background_interval != 0 && Wifi_is_connected()) ||
+         (supervisor_enabled && (wifi_wanted || tcp_wanted || in_outage)) ||
+         tx_queue_held();
+}
+
+/**
+ * @brief Schedules the next housekeeping tick if a job needs it, and
+ * the jobs which have their own deadline. Called after each mail.
+ **/
+static void housekeeping_schedule(void) {
+  if (is_suspended)
+    return;
+
+  if (!housekeeping_running && housekeeping_needed()) {
+    housekeeping_running = TRUE;
+    housekeeping_due = UPTIME_MS() + HOUSEKEEPING_PERIOD;
+  }
+  if (housekeeping_running)
+    timer_request(housekeeping_due);
+
+  timer_request(perf_flush_time + PERF_FLUSH_PERIOD);
+  if ((sntp_flags & SNTP_AUTO) && sntp_next != 0 && Wifi_is_connected())
+    timer_request(sntp_next);
+  if (Wifi_is_connected())
+    timer_request(wifi_rssi_time + RSSI_SAMPLE_PERIOD);
+
+  #ifdef FAULT_INJECTION
+  if (fault_config.disconnect != 0 && TCP_is_connected)
+    timer_request(fault_last_disconnect + fault_config.disconnect * 1000UL);
+  #endif
+}
+
+/**
+ * @brief Puts the microcontroller to sleep if nothing is left to do
+ * until the next interrupt: PtMain waits for a command from the host and
+ * no job, send or connection phase is in progress. EM2 is used when the
+ * next timer is not due soon, and EM1 otherwise. The SPI chip select,
+ * the timers and the WiFi chip interrupt wake it up.
+ * The task cannot see its mail queue, so it only sleeps when the timer
+ * armed IDLE_SETTLE_MS before is the only mail received since then.
+ * @param Mail : mail just handled by ColaTask
+ **/
+static void idle_enter(const RosMailType *Mail) {
+  rsuint32 start;
+  int i;
+
+  idle_mails++;
+  if (idle_mode == IDLE_OFF || !spi_waiting_command || radio_busy ||
+      tx_in_flight || tx_queue_count) {
+    idle_settling = FALSE;
+    return;
+  }
+  for (i = 0; i < PHASE_COUNT; i++) {
+    if (phase_stats[i].running) {
+      idle_settling = FALSE;
+      return;
+    }
+  }
+
+  // Wait for a quiet period first
+  if (!idle_settling || idle_mails != idle_settle_mails + 1 ||
+      !IS_RECEIVED(APP_PACKET_DELAY_TIMEOUT) ||
+      !TIME_REACHED(idle_settle_due)) {
+    idle_settling = TRUE;
+    idle_settle_mails = idle_mails;
+    idle_settle_due = UPTIME_MS() + IDLE_SETTLE_MS;
+    timer_request(idle_settle_due);
+    return;
+  }
+  idle_settling = FALSE;
+
+  start = UPTIME_MS();
+  if (idle_mode == IDLE_EM2 &&
+      (!timer_armed ||
+       (rsint32)(timer_due - start) >= IDLE_EM2_MIN_SLEEP)) {
+    mcu_in_em2 = TRUE;
+    energy_update();
+    EMU_EnterEM2();
+    mcu_in_em2 = FALSE;
+    energy_update();
+    idle_entries[1]++;
+    idle_time[1] += UPTIME_MS() - start;
+  }
+  else {
+    EMU_EnterEM1();
+    idle_entries[0]++;
+    idle_time[0] += UPTIME_MS() - start;
+  }
+}
+
 /**
  * @brief Main CoLa task event handler
  * @param Mail : protothread mail
@@ -1382,6 +5550,66 @@ void ColaTask(const RosMailType *Mail) {
 
       // Start the Main protothread
       PtStart(&PtList, PtMain, NULL, NULL);
+
+      LOG_INFO(LOG_BOOT, 0, 0);
+
+      // Start the background jobs
+      PtStart(&PtList, PtBackgroundScan, NULL, NULL);
+      PtStart(&PtList, PtSupervisor, NULL, NULL);
+      PtStart(&PtList, PtPreconnect, NULL, NULL);
+      PtStart(&PtList, PtDeferral, NULL, NULL);
+      PtStart(&PtList, PtSntp, NULL, NULL);
+
+      // Cycle counter used to benchmark the frame encoder
+      CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+      DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+      break;
+
+    case APP_PACKET_DELAY_TIMEOUT:
+      // A deadline was reached: the waiting protothreads check theirs
+      // when the mail is dispatched, and arm the timer again if needed
+      timer_armed = FALSE;
+      if (housekeeping_running && TIME_REACHED(housekeeping_due)) {
+        housekeeping_running = FALSE; // Until housekeeping_schedule
+        housekeeping_ticked = TRUE;
+        energy_update();
+
+        #ifdef USE_LUART_TERMINAL
+        log_flush_to_uart();
+        #endif
+      }
+
+      if (UPTIME_MS() - perf_flush_time >= PERF_FLUSH_PERIOD)
+        perf_flush();
+
+      if ((sntp_flags & SNTP_AUTO) && sntp_next != 0 &&
+          TIME_REACHED(sntp_next) && Wifi_is_connected()) {
+        sntp_next = 0;
+        sntp_pending = TRUE;
+      }
+
+      #ifdef FAULT_INJECTION
+      // Drop the TCP session to exercise the link supervisor
+      if (fault_config.disconnect != 0 && TCP_is_connected &&
+          UPTIME_MS() - fault_last_disconnect >=
+          fault_config.disconnect * 1000UL) {
+        fault_last_disconnect = UPTIME_MS();
+        fault_count[2]++;
+        SendApiSocketCloseReq(COLA_TASK, socketHandle);
+      }
+      #endif
+
+      // Sample the RSSI for the extended status
+      if (Wifi_is_connected() && !is_suspended &&
+          UPTIME_MS() - wifi_rssi_time >= RSSI_SAMPLE_PERIOD) {
+        wifi_rssi_time = UPTIME_MS();
+        SendApiWifiGetRssiReq(COLA_TASK);
+      }
+      break;
+
+    case API_WIFI_GET_RSSI_CFM:
+      if (((ApiWifiGetRssiCfmType *)Mail)->Status == RSS_SUCCESS)
+        wifi_rssi = ((ApiWifiGetRssiCfmType *)Mail)->Rssi;
       break;
 
     case TERMINATETASK:
@@ -1389,57 +5617,88 @@ void ColaTask(const RosMailType *Mail) {
       break;
       
     case API_SOCKET_SEND_CFM:
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("API_SOCKET_SEND_CFM (send confirmation)");    
-      
-      if (((ApiSocketSendCfmType *)Mail)->Status == RSS_SUCCESS)
-        PRINTLN("Send OK");
-      else
-        PRINTLN("Send ERROR");
-      #endif
+      // Late confirmations of a closed session are ignored
+      if (((ApiSocketSendCfmType *)Mail)->Handle == socketHandle)
+        tx_queue_confirm(((ApiSocketSendCfmType *)Mail)->Status);
+      break;
+
+    case API_WIFI_CONNECT_IND:
+      // Associated: the DHCP exchange starts now
+      phase_end(PHASE_ASSOCIATE);
+      if (app_data.use_dhcp)
+        phase_begin(PHASE_DHCP);
+      break;
+
+    case APP_EVENT_IP_ADDR_RECEIVED:
+      phase_end(PHASE_DHCP);
+      if (app_data.use_dhcp && !lease_in_use) {
+        dhcp_acquired_ms = UPTIME_MS();
+        if (dhcp_acquired_ms == 0)
+          dhcp_acquired_ms = 1; // Zero means not obtained since boot
+        dhcp_acquired_time = time_now(NULL);
+        if (app_data.lease_policy != LEASE_CACHE_OFF)
+          dhcp_lease_store();
+      }
+      break;
+
+    case API_WIFI_DISCONNECT_IND:
+      phase_abort(PHASE_DHCP);
       break;
 
     case APP_EVENT_SOCKET_CLOSED:
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("APP_EVENT_SOCKET_CLOSED");
-      #endif
       TCP_is_connected = false;
+      tx_queue_flush();
       break;    
 
     case API_SOCKET_CLOSE_IND:
-      #ifdef USE_LUART_TERMINAL
-      PRINTLN("API_SOCKET_CLOSE_IND");
-      #endif
+      LOG_INFO(LOG_SOCKET_CLOSED, 0, 0);
+      if (phase_stats[PHASE_TCP_CONNECT].running)
+        LOG_ERROR(LOG_TCP_START_FAILED,
+                  UPTIME_MS() - phase_stats[PHASE_TCP_CONNECT].start, 0);
       TCP_is_connected = false;
+      if (!supervisor_tcp)
+        tcp_wanted = FALSE; // A session ended by the server is not an outage
+      tx_queue_flush();
+      phase_abort(PHASE_TCP_CONNECT);
+      break;
+
+    case API_SOCKET_RECEIVE_FROM_IND: {
+      // Datagrams are freed by the waiting UDP client. Late responses are
+      // dropped here.
+      ApiSocketReceiveFromIndType *socket =
+        (ApiSocketReceiveFromIndType *)Mail;
+      if (!udp_waiting || socket->Handle != udp_socket)
+        SendApiSocketFreeBufferReq(COLA_TASK, socket->Handle,
+                                   socket->BufferPtr);
       break;
+    }
 
     case API_SOCKET_RECEIVE_IND: {
-      #ifdef USE_LUART_TERMINAL
-        PRINTLN("API_SOCKET_RECEIVE_IND");
-      #endif
 
-      // Save pointer to TCP allocated buffer.
-      // The buffer will be freed in Wifi_TCP_receive().
+      // Keep the TCP allocated buffer until it is read (commands #9 and
+      // #18, or Wifi_TCP_receive). It is freed once completely read, so
+      // the TCP window follows the rate at which the host reads.
+      // This activates the flag that indicates that TCP data has been
+      // received.
+      // Data still arriving for a closed socket is dropped.
       ApiSocketReceiveIndType *socket = (ApiSocketReceiveIndType *)Mail;
-      TCP_receive_buffer_ptr = socket->BufferPtr;
-      TCP_Rx_bufferLength = socket->BufferLength;
-      
-      // Move data to rx_buffer
-      TCP_Rx_bufferLength = socket->BufferLength;
-      if (TCP_Rx_bufferLength >= TX_BUFFER_LENGTH)
-        TCP_Rx_bufferLength = TX_BUFFER_LENGTH;
-      memcpy(rx_buffer, socket->BufferPtr, TCP_Rx_bufferLength);
-
-      // Activate the flag that indicates that TCP data has been received.
-      // The buffer is not freed. The data must be read with Wifi_TCP_receive,
-      // which will read the data clear and clear the buffer.    
-      TCP_received = true;
+      LOG_DEBUG(LOG_RX_DATA, socket->BufferLength, 0);
+      if (socketHandle == 0 || socket->Handle != socketHandle)
+        SendApiSocketFreeBufferReq(COLA_TASK, socket->Handle,
+                                   socket->BufferPtr);
+      else if (!rx_queue_push(socket->Handle, socket->BufferPtr,
+                              socket->BufferLength))
+        LOG_ERROR(LOG_RX_OVERFLOW, socket->BufferLength, 0);
       break;
     }
   }
 
   // Dispatch mail to all protothreads started
   PtDispatchMail(&PtList, Mail);
+  housekeeping_ticked = FALSE;
+  housekeeping_schedule();
+
+  idle_enter(Mail);
 }
 
 // End of file.
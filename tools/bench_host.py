@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Runs the connection cycles of the terminal "bench" command on the host.
+
+The "dns" and "tcp" cycles are timed as PtBench does on the board: "dns"
+resolves the name, and "tcp" resolves it, connects to port 80 (or
+--port), sends an HTTP/1.0 request, waits for the first bytes of the
+answer and closes. A cycle whose name is not resolved fails without
+connecting. The report has the same format as the one of the board, so
+both can be compared.
+
+With --scenario the server is tools/sim_server.py, started in the same
+process on a free port with the given scenario, so that a CI job runs
+the benchmark without any network. The exit status is 1 when more cycles
+fail than --max-failures.
+
+Usage: bench_host.py dns|tcp n [name] [--port n] [--scenario file]
+                     [--max-failures n]
+"""
+
+import argparse
+import os
+import socket
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import sim_server  # noqa: E402
+
+BENCH_MAX_ITERATIONS = 64
+BENCH_TIMEOUT = 15  # s, for each wait of an iteration
+REQUEST = b"GET / HTTP/1.0\r\n\r\n"
+
+
+def resolve(name):
+    """Returns the IPv4 address of a name, or None."""
+    try:
+        return socket.getaddrinfo(name, None, socket.AF_INET)[0][4][0]
+    except socket.gaierror:
+        return None
+
+
+def tcp_cycle(ip, port):
+    """Connects, sends the request and waits for an answer."""
+    try:
+        with socket.create_connection((ip, port), BENCH_TIMEOUT) as s:
+            s.sendall(REQUEST)
+            return len(s.recv(1024)) > 0
+    except OSError:
+        return False
+
+
+def report(samples, failures):
+    """Returns the summary line, as bench_report on the board."""
+    count = len(samples)
+    if count == 0:
+        return "ok=0 failed=%d" % failures
+    samples = sorted(samples)
+    return "ok=%d failed=%d min=%d median=%d p95=%d max=%d ms" % (
+        count, failures, samples[0], samples[count // 2],
+        samples[(count * 95 + 99) // 100 - 1], samples[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("cycle", choices=["dns", "tcp"])
+    parser.add_argument("iterations", type=int)
+    parser.add_argument("name", nargs="?", default="www.example.com")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--scenario",
+                        help="serve with sim_server.py and this scenario")
+    parser.add_argument("--max-failures", type=int, default=0)
+    args = parser.parse_args()
+
+    name, port = args.name, args.port
+    if args.scenario:
+        server = sim_server.SimServer(("127.0.0.1", 0),
+                                      sim_server.load_scenario(args.scenario),
+                                      quiet=True)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        name, port = "localhost", server.server_address[1]
+
+    samples = []
+    failures = 0
+    for i in range(min(args.iterations, BENCH_MAX_ITERATIONS)):
+        start = time.monotonic()
+        ip = resolve(name)
+        if args.cycle == "dns":
+            ok = ip is not None
+        elif ip is None:
+            ok = False
+        else:
+            start = time.monotonic()  # As the board, without the DNS
+            ok = tcp_cycle(ip, port)
+        elapsed = int((time.monotonic() - start) * 1000)
+        if ok:
+            samples.append(elapsed)
+        else:
+            failures += 1
+        print("%d: %s %d ms" % (i + 1, "ok" if ok else "failed", elapsed))
+
+    print(report(samples, failures))
+    sys.exit(1 if failures > args.max_failures else 0)
+
+
+if __name__ == "__main__":
+    main()
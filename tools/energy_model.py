@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Energy model of the RTX4100 and benchmark of upload strategies.
+
+It uses the same model as the estimator of the firmware (commands #27
+and #28). The radio and the MCU are each in one state at any time. The
+charge is the time in each state multiplied by the current of the state,
+and the current above idle of the TX state scales with the transmit
+power.
+
+The benchmark builds the state timeline of a standard upload cycle under
+each strategy between uploads:
+
+  profile0..3  stay associated with that powersave profile (command #12)
+  suspend      suspend the WiFi chip (commands #14 and #15)
+  poweroff     power the WiFi chip off and on (command #11)
+  warm         warm poweroff (command #11 with 2): the DHCP lease and the
+               resolved name are kept, so DHCP and DNS are skipped
+
+For each one it reports the charge per upload and the projected battery
+life. The currents and the phase durations are defaults, to be replaced
+with measurements: --currents takes the 11 currents of command #28, in
+uA, and --phases a JSON object with the durations in ms (the averages of
+command #16 are a good source).
+
+Usage: energy_model.py [--period s] [--bytes n] [--battery mAh]
+                       [--tx-power p] [--idle em1|em2]
+                       [--currents file] [--phases file]
+"""
+
+import argparse
+import json
+
+STATES = ["off", "sleep", "idle0", "idle1", "idle2", "idle3", "scan",
+          "connect", "tx", "em1", "em2"]
+
+# Same defaults as energy_current[] in Main.c, in uA
+DEFAULT_CURRENTS = [5, 60, 1500, 5000, 20000, 80000, 120000, 100000,
+                    250000, 3000, 2]
+
+MAX_TX_POWER = 18
+
+# Durations of the phases, in ms
+DEFAULT_PHASES = {
+    "reset": 800,       # PtAppWifiReset, after a poweron
+    "scan": 2500,
+    "associate": 1500,
+    "dhcp": 1200,
+    "dns": 150,
+    "tcp": 200,
+    "tx_per_kb": 40,    # Send, at full transmit power
+    "response": 300,    # Wait for the answer of the server
+    "suspend": 20,      # Suspend and resume requests
+    "resume": 30,
+}
+
+# Fixed waits of PtWifi_connect around the association, in ms
+CONNECT_WAITS = 1000 + 2000
+
+
+def state_current(state, currents, tx_power):
+    """Returns the current of a state in uA, as energy_state_current."""
+    i = STATES.index(state)
+    if state == "tx":
+        idle, tx = currents[STATES.index("idle3")], currents[i]
+        if tx > idle:
+            return idle + (tx - idle) * tx_power // MAX_TX_POWER
+    return currents[i]
+
+
+def upload_cycle(strategy, phases, period_ms, size):
+    """Returns the (radio state, ms, MCU busy) steps of an upload cycle.
+
+    The MCU is in EM1 while busy, and sleeps in the idle mode otherwise.
+    """
+    send = [("tx", phases["tx_per_kb"] * size / 1024.0, True),
+            ("idle3", phases["response"], True)]
+    connect = [("connect", phases["associate"], True),
+               ("idle3", CONNECT_WAITS, True)]
+
+    if strategy.startswith("profile"):
+        steps = send
+        rest = "idle" + strategy[-1]
+    elif strategy == "suspend":
+        steps = [("idle3", phases["resume"], True),
+                 ("connect", phases["tcp"], True)] + send + \
+                [("idle3", phases["suspend"], True)]
+        rest = "sleep"
+    elif strategy in ("poweroff", "warm"):
+        steps = [("idle3", phases["reset"], True),
+                 ("scan", phases["scan"], True)] + connect
+        if strategy == "poweroff":
+            steps += [("connect", phases["dhcp"], True),
+                      ("connect", phases["dns"], True)]
+        steps += [("connect", phases["tcp"], True)] + send
+        rest = "off"
+    else:
+        raise ValueError(strategy)
+
+    busy = sum(ms for _, ms, _ in steps)
+    if busy > period_ms:
+        raise ValueError("%s: the cycle takes %d ms, more than the period"
+                         % (strategy, busy))
+    return steps + [(rest, period_ms - busy, False)]
+
+
+def charge_uah(steps, currents, tx_power, idle):
+    """Returns the charge of a cycle in uAh, and the time in each state."""
+    charge_nc = 0.0
+    times = dict((s, 0.0) for s in STATES)
+    for radio, ms, busy in steps:
+        mcu = "em1" if busy or idle == "em1" else "em2"
+        current = (state_current(radio, currents, tx_power) +
+                   state_current(mcu, currents, tx_power))
+        charge_nc += ms * current
+        times[radio] += ms
+        times[mcu] += ms
+    return charge_nc / 3.6e6, times
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--period", type=float, default=600,
+                        help="seconds between uploads (600)")
+    parser.add_argument("--bytes", type=int, default=500,
+                        help="bytes sent per upload (500)")
+    parser.add_argument("--battery", type=float, default=2000,
+                        help="battery capacity in mAh (2000)")
+    parser.add_argument("--tx-power", type=int, default=MAX_TX_POWER,
+                        help="transmit power, as command #13")
+    parser.add_argument("--idle", choices=["em1", "em2"], default="em2",
+                        help="sleep mode of the MCU between uploads")
+    parser.add_argument("--currents", help="JSON list of the 11 currents")
+    parser.add_argument("--phases", help="JSON object of phase durations")
+    args = parser.parse_args()
+
+    currents = list(DEFAULT_CURRENTS)
+    if args.currents:
+        with open(args.currents) as f:
+            currents = json.load(f)
+        if len(currents) != len(STATES):
+            parser.error("%d currents expected" % len(STATES))
+    phases = dict(DEFAULT_PHASES)
+    if args.phases:
+        with open(args.phases) as f:
+            phases.update(json.load(f))
+
+    period_ms = args.period * 1000
+    print("%-9s %12s %12s %12s" % ("strategy", "uAh/upload", "avg uA",
+                                   "life (days)"))
+    for strategy in ["profile0", "profile1", "profile2", "profile3",
+                     "suspend", "poweroff", "warm"]:
+        try:
+            steps = upload_cycle(strategy, phases, period_ms, args.bytes)
+        except ValueError as e:
+            print("%-9s %s" % (strategy, e))
+            continue
+        charge, _ = charge_uah(steps, currents, args.tx_power, args.idle)
+        average = charge * 3600e3 / period_ms
+        life = args.battery * 1000 / average / 24
+        print("%-9s %12.2f %12.1f %12.1f" % (strategy, charge, average, life))
+
+
+if __name__ == "__main__":
+    main()
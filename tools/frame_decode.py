@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""Decodes the frames sent with the encoding of command #34.
+
+The input is the data received by the server on one TCP connection, as
+raw bytes or as hexadecimal text. Each frame is the flags (rsuint8), the
+original length and the encoded length (rsuint16 each, little-endian)
+and the encoded data. The LZSS compression (flag 2) is undone first, and
+then the delta (flag 1) against the previous frame.
+
+The static dictionary is read from LzDictionary[] in Main.c, so the
+decoder follows the firmware it is given.
+
+Usage: frame_decode.py [--hex] [--source Main.c] stream
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+ENCODE_DELTA = 1
+ENCODE_LZ = 2
+HEADER = struct.Struct("<BHH")
+LZ_MIN_MATCH = 3
+
+
+def read_dictionary(source):
+    """Returns the LzDictionary[] bytes of Main.c."""
+    with open(source) as f:
+        text = f.read()
+    table = re.search(r"LzDictionary\[\]\s*=(.*?);", text, re.S)
+    if table is None:
+        sys.exit("LzDictionary[] not found in " + source)
+    return b"".join(bytes(s, "ascii").decode("unicode_escape").encode("latin-1")
+                    for s in re.findall(r'"((?:[^"\\]|\\.)*)"', table.group(1)))
+
+
+def lz_decompress(data, length, dictionary):
+    """Returns the length bytes compressed with lz_compress."""
+    window = bytearray(dictionary)
+    pos = 0
+    while len(window) - len(dictionary) < length:
+        flags = data[pos]
+        pos += 1
+        for token in range(8):
+            if len(window) - len(dictionary) >= length:
+                break
+            if flags & (1 << token):
+                low, high = data[pos], data[pos + 1]
+                pos += 2
+                start = len(window) - (low | (high >> 4) << 8)
+                # The match may overlap the bytes it produces
+                for i in range(LZ_MIN_MATCH + (high & 0x0f)):
+                    window.append(window[start + i])
+            else:
+                window.append(data[pos])
+                pos += 1
+    return bytes(window[len(dictionary):])
+
+
+def decode(data, dictionary):
+    """Yields the decoded frames of a stream."""
+    prev = b""
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        flags, length, encoded = HEADER.unpack_from(data, pos)
+        pos += HEADER.size
+        if pos + encoded > len(data):
+            sys.exit("truncated frame at byte %d" % (pos - HEADER.size))
+        frame = data[pos:pos + encoded]
+        pos += encoded
+        if flags & ENCODE_LZ:
+            frame = lz_decompress(frame, length, dictionary)
+        if flags & ENCODE_DELTA:
+            if len(prev) != length:
+                sys.exit("delta without a previous frame of %d bytes" % length)
+            frame = bytes((a + b) & 0xff for a, b in zip(frame, prev))
+        prev = frame
+        yield frame
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("stream", help="data received on one connection")
+    parser.add_argument("--hex", action="store_true",
+                        help="the stream is hexadecimal text")
+    parser.add_argument("--source",
+                        default=os.path.join(os.path.dirname(__file__),
+                                             "..", "Main.c"),
+                        help="firmware source with LzDictionary[]")
+    args = parser.parse_args()
+
+    dictionary = read_dictionary(args.source)
+    if args.hex:
+        with open(args.stream) as f:
+            data = bytes.fromhex("".join(f.read().split()))
+    else:
+        with open(args.stream, "rb") as f:
+            data = f.read()
+    for frame in decode(data, dictionary):
+        print(frame.decode("latin-1"))
+
+
+if __name__ == "__main__":
+    main()
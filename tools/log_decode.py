@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Decodes the binary log read with SPI command #26.
+
+The input is the concatenation of the responses of command #26, as raw
+bytes or as hexadecimal text. Each response is the number of records
+(rsuint8), the number of records lost (rsuint16) and 13-byte records:
+uptime in ms (rsuint32), level (rsuint8), message token (rsuint8) and two
+arguments (rsuint32 each), all little-endian.
+
+The format strings are read from LogFormats[] in Main.c, so the decoder
+follows the firmware it is given.
+
+Usage: log_decode.py [--hex] [--source Main.c] dump
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+LEVELS = ["ERROR", "WARNING", "INFO", "DEBUG"]
+RECORD = struct.Struct("<IBBII")
+
+
+def read_formats(source):
+    """Returns the LogFormats[] strings of Main.c, in token order."""
+    with open(source) as f:
+        text = f.read()
+    table = re.search(r"LogFormats\[LOG_MSG_COUNT\]\s*=\s*\{(.*?)\};", text,
+                      re.S)
+    if table is None:
+        sys.exit("LogFormats[] not found in " + source)
+    return [bytes(s, "ascii").decode("unicode_escape")
+            for s in re.findall(r'"((?:[^"\\]|\\.)*)"', table.group(1))]
+
+
+def decode(data, formats):
+    """Yields a text line for each record and each gap in the log."""
+    pos = 0
+    while pos + 3 <= len(data):
+        count = data[pos]
+        dropped = struct.unpack_from("<H", data, pos + 1)[0]
+        pos += 3
+        if dropped:
+            yield "-- %d records lost --" % dropped
+        for _ in range(count):
+            if pos + RECORD.size > len(data):
+                yield "-- truncated record --"
+                return
+            time, level, msg, a, b = RECORD.unpack_from(data, pos)
+            pos += RECORD.size
+            if msg < len(formats):
+                n = formats[msg].count("%") - 2 * formats[msg].count("%%")
+                text = formats[msg] % (a, b)[:n]
+            else:
+                text = "unknown message %d (%08x %08x)" % (msg, a, b)
+            name = LEVELS[level] if level < len(LEVELS) else str(level)
+            yield "[%10d] %-7s %s" % (time, name, text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("dump", help="responses of command #26")
+    parser.add_argument("--hex", action="store_true",
+                        help="the dump is hexadecimal text")
+    parser.add_argument("--source",
+                        default=os.path.join(os.path.dirname(__file__),
+                                             "..", "Main.c"),
+                        help="firmware source with LogFormats[]")
+    args = parser.parse_args()
+
+    formats = read_formats(args.source)
+    if args.hex:
+        with open(args.dump) as f:
+            data = bytes.fromhex("".join(f.read().split()))
+    else:
+        with open(args.dump, "rb") as f:
+            data = f.read()
+    for line in decode(data, formats):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Computes the WPA PMK of a profile and benchmarks its derivation.
+
+The PMK is PBKDF2-HMAC-SHA1 of the passphrase, with the SSID as salt,
+4096 iterations and 32 bytes, as PtWifi_derive_PMK computes it on the
+board. Given an SSID and a passphrase, it prints the PMK as the 64 hex
+digits which command #7 stores, so the key can also be configured
+directly as a PMK.
+
+With --bench it times n derivations of the IEEE 802.11i test vector on
+the host and prints the same report as the "pmkbench" command of the
+terminal build. It also gives the number of SHA-1 compressions of a
+derivation, which is the work the board does. With the cycles per
+derivation printed by "pmkbench" and the clock of the board, it gives
+the time that each association saves once the PMK is stored.
+
+Usage: pmk_bench.py [ssid passphrase] [--bench n]
+                    [--board-cycles n] [--clock MHz]
+"""
+
+import argparse
+import hashlib
+import time
+
+PMK_LENGTH = 32
+PMK_ITERATIONS = 4096
+SHA1_LENGTH = 20
+SHA1_BLOCK_LENGTH = 64
+
+TEST_SSID = "IEEE"
+TEST_PASSPHRASE = "password"
+TEST_PMK = "f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e"
+
+
+def derive_pmk(ssid, passphrase):
+    """Returns the PMK in hex, as stored at the NVS."""
+    return hashlib.pbkdf2_hmac("sha1", passphrase.encode(), ssid.encode(),
+                               PMK_ITERATIONS, PMK_LENGTH).hex()
+
+
+def sha1_blocks(length):
+    """Returns the SHA-1 compressions of a message of length bytes."""
+    return (length + 9 + SHA1_BLOCK_LENGTH - 1) // SHA1_BLOCK_LENGTH
+
+
+def compressions(ssid):
+    """Returns the SHA-1 compressions of a derivation on the board.
+
+    The inner and outer pads are hashed once. Then each HMAC of the
+    chain costs one inner and one outer compression.
+    """
+    blocks = (PMK_LENGTH + SHA1_LENGTH - 1) // SHA1_LENGTH
+    # U1: the SSID and the block number after the inner pad, and the outer
+    first = sha1_blocks(SHA1_BLOCK_LENGTH + len(ssid) + 4)
+    chain = (PMK_ITERATIONS - 1) * 2
+    return 2 + blocks * (first + chain)
+
+
+def report(samples, failures):
+    """Returns the summary line, as bench_report on the board."""
+    count = len(samples)
+    if count == 0:
+        return "ok=0 failed=%d" % failures
+    samples = sorted(samples)
+    return "ok=%d failed=%d min=%d median=%d p95=%d max=%d ms" % (
+        count, failures, samples[0], samples[count // 2],
+        samples[(count * 95 + 99) // 100 - 1], samples[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("ssid", nargs="?")
+    parser.add_argument("passphrase", nargs="?")
+    parser.add_argument("--bench", type=int, metavar="n",
+                        help="time n derivations of the test vector")
+    parser.add_argument("--board-cycles", type=int, metavar="n",
+                        help="cycles per derivation printed by pmkbench")
+    parser.add_argument("--clock", type=float, default=48,
+                        help="clock of the board in MHz (48)")
+    args = parser.parse_args()
+
+    if args.ssid is not None:
+        if args.passphrase is None or not 8 <= len(args.passphrase) <= 63:
+            parser.error("the passphrase must have 8 to 63 characters")
+        print(derive_pmk(args.ssid, args.passphrase))
+
+    if args.bench:
+        samples = []
+        failures = 0
+        for _ in range(args.bench):
+            start = time.perf_counter()
+            ok = derive_pmk(TEST_SSID, TEST_PASSPHRASE) == TEST_PMK
+            elapsed = (time.perf_counter() - start) * 1000
+            if ok:
+                samples.append(elapsed)
+            else:
+                failures += 1
+        print(report(samples, failures))
+        print("%d SHA-1 compressions per derivation" %
+              compressions(TEST_SSID))
+
+    if args.board_cycles:
+        seconds = args.board_cycles / (args.clock * 1e6)
+        print("%.2f s per derivation on the board, %d cycles per "
+              "compression" % (seconds,
+                               args.board_cycles // compressions(TEST_SSID)))
+
+
+if __name__ == "__main__":
+    main()
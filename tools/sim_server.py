@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Host stand-in of the server reached by the RTX4100.
+
+It accepts TCP connections and answers them as the upload server would:
+requests starting with "GET " get an HTTP/1.0 response from a small set
+of documents (with ETag validators, for command #32), and any other data
+is echoed back (commands #10, #19 and #39). The connection is closed
+after an HTTP response, as the server does for HTTP/1.0 requests.
+
+A scenario file gives the network conditions, so that a run can be
+repeated exactly with the same seed. It is a JSON object with these
+optional keys:
+
+  seed            seed of the pseudo-random faults (1)
+  accept_delay    delay before a new connection is served, in ms (0)
+  response_delay  delay before each response, in ms (0)
+  drop            percentage of connections closed without an answer (0)
+  close_after     responses after which the session is closed, 0 never
+  documents       object which maps a path to {"body", "etag",
+                  "status", "chunked"}
+
+Each connection and each response is logged on the standard output.
+
+Usage: sim_server.py [--port n] [--scenario file]
+"""
+
+import argparse
+import json
+import random
+import socketserver
+import sys
+import threading
+import time
+
+DEFAULT_SCENARIO = {
+    "seed": 1,
+    "accept_delay": 0,
+    "response_delay": 0,
+    "drop": 0,
+    "close_after": 0,
+    "documents": {
+        "/config.json": {"body": "{\"period\":600}", "etag": "\"v1\""},
+    },
+}
+
+
+def load_scenario(path):
+    """Returns the scenario of a file, with the defaults of missing keys."""
+    scenario = dict(DEFAULT_SCENARIO)
+    if path:
+        with open(path) as f:
+            scenario.update(json.load(f))
+    return scenario
+
+
+def http_response(scenario, request):
+    """Returns the response to an HTTP request, as bytes."""
+    lines = request.decode("latin-1").split("\r\n")
+    path = lines[0].split(" ")[1] if len(lines[0].split(" ")) > 1 else "/"
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            name, value = line.split(":", 1)
+            headers[name.strip().lower()] = value.strip()
+
+    document = scenario["documents"].get(path)
+    if document is None:
+        return b"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n"
+    etag = document.get("etag")
+    if etag is not None and headers.get("if-none-match") == etag:
+        return b"HTTP/1.0 304 Not Modified\r\nETag: %s\r\n\r\n" % \
+            etag.encode("latin-1")
+
+    body = document.get("body", "").encode("latin-1")
+    head = "HTTP/1.0 %d OK\r\n" % document.get("status", 200)
+    if etag is not None:
+        head += "ETag: %s\r\n" % etag
+    if document.get("chunked"):
+        head += "Transfer-Encoding: chunked\r\n\r\n"
+        return head.encode("latin-1") + b"%x\r\n%s\r\n0\r\n\r\n" % \
+            (len(body), body)
+    head += "Content-Length: %d\r\n\r\n" % len(body)
+    return head.encode("latin-1") + body
+
+
+class SimHandler(socketserver.BaseRequestHandler):
+    """Serves one connection under the conditions of the scenario."""
+
+    def handle(self):
+        server = self.server
+        scenario = server.scenario
+        with server.lock:
+            server.connections += 1
+            number = server.connections
+            dropped = server.random.randrange(100) < scenario["drop"]
+        server.log("%d: connection from %s:%d%s" %
+                   (number, self.client_address[0], self.client_address[1],
+                    ", dropped" if dropped else ""))
+        if dropped:
+            return
+        time.sleep(scenario["accept_delay"] / 1000.0)
+
+        responses = 0
+        pending = b""
+        while True:
+            try:
+                data = self.request.recv(1024)
+            except OSError:
+                break
+            if not data:
+                break
+            pending += data
+            if pending.startswith(b"GET "):
+                if b"\r\n\r\n" not in pending:
+                    continue
+                response = http_response(scenario, pending)
+                close = True
+            else:
+                response = pending
+                close = False
+            pending = b""
+
+            time.sleep(scenario["response_delay"] / 1000.0)
+            self.request.sendall(response)
+            responses += 1
+            server.log("%d: %d bytes in, %d bytes out" %
+                       (number, len(data), len(response)))
+            if close or responses == scenario["close_after"]:
+                break
+        server.log("%d: closed after %d responses" % (number, responses))
+
+
+class SimServer(socketserver.ThreadingTCPServer):
+    """TCP server with the state of a scenario."""
+
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, address, scenario, quiet=False):
+        socketserver.ThreadingTCPServer.__init__(self, address, SimHandler)
+        self.scenario = scenario
+        self.random = random.Random(scenario["seed"])
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.quiet = quiet
+
+    def log(self, text):
+        if not self.quiet:
+            print(text)
+            sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--port", type=int, default=8080,
+                        help="TCP port (8080)")
+    parser.add_argument("--scenario", help="JSON scenario file")
+    args = parser.parse_args()
+
+    server = SimServer(("", args.port), load_scenario(args.scenario))
+    print("listening on port %d" % server.server_address[1])
+    sys.stdout.flush()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()